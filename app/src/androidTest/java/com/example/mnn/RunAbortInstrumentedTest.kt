@@ -0,0 +1,126 @@
+package com.example.mnn
+
+import android.graphics.Bitmap
+import android.graphics.Color
+import androidx.test.ext.junit.runners.AndroidJUnit4
+import androidx.test.platform.app.InstrumentationRegistry
+
+import org.junit.Assume.assumeTrue
+import org.junit.Before
+import org.junit.Test
+import org.junit.runner.RunWith
+
+import org.junit.Assert.*
+
+import java.io.File
+import java.util.concurrent.atomic.AtomicBoolean
+
+/**
+ * 算子级取消 / 时间预算：中止后的返回状态、输出 Bitmap 不被写入、Session 可继续使用。
+ *
+ * 需要先在 App 内导入 Encoder.mnn / Flow.mnn / Decoder.mnn (位于 cacheDir)，缺失时跳过。
+ */
+@RunWith(AndroidJUnit4::class)
+class RunAbortInstrumentedTest {
+
+    private lateinit var activity: MainActivity
+    private lateinit var src: Bitmap
+
+    @Before
+    fun setUp() {
+        val instrumentation = InstrumentationRegistry.getInstrumentation()
+        val cacheDir = instrumentation.targetContext.cacheDir
+        assumeTrue("models not imported",
+            listOf("Encoder.mnn", "Flow.mnn", "Decoder.mnn").all { File(cacheDir, it).exists() })
+
+        // 只用来调用 native 方法 (加载 .so)，不走 onCreate；ComponentActivity 需在主线程构造
+        instrumentation.runOnMainSync { activity = MainActivity() }
+        assertTrue(activity.initEngine(cacheDir.absolutePath))
+
+        src = Bitmap.createBitmap(SIZE, SIZE, Bitmap.Config.ARGB_8888)
+        src.eraseColor(Color.rgb(120, 160, 200))
+    }
+
+    @Test
+    fun cancelDuringFlowLoop() {
+        val dst = sentinelBitmap()
+        val cancelled = AtomicBoolean(false)
+        // 第一步进度回调时取消，此时已进入 Flow 循环
+        val jobId = activity.submitStyleJob(src, 0, STEPS, FlowOptions(), { id, step, _, _ ->
+            if (step >= 1 && cancelled.compareAndSet(false, true)) {
+                activity.cancelJob(id)
+            }
+        }, false)
+        assertTrue(jobId > 0)
+
+        val info = waitJob(jobId)
+        assertTrue(cancelled.get())
+        assertEquals(JobState.CANCELLED, info[0])
+        assertTrue("aborted before the last step", info[1] < STEPS)
+        assertFalse(activity.fetchJobResult(jobId, dst))
+        assertUnwritten(dst)
+
+        assertEngineReusable()
+    }
+
+    @Test
+    fun expiredDeadlineSync() {
+        val dst = sentinelBitmap()
+        assertFalse(activity.runStyleTransfer(src, dst, 0, STEPS, FlowOptions(deadlineMs = 1f)))
+        assertTrue(activity.getLastRunStats().contains("deadline_at="))
+        assertUnwritten(dst)
+
+        assertEngineReusable()
+    }
+
+    @Test
+    fun expiredDeadlineJob() {
+        val dst = sentinelBitmap()
+        val jobId = activity.submitStyleJob(src, 0, STEPS, FlowOptions(deadlineMs = 1f), null, false)
+        assertTrue(jobId > 0)
+
+        assertEquals(JobState.TIMED_OUT, waitJob(jobId)[0])
+        assertFalse(activity.fetchJobResult(jobId, dst))
+        assertUnwritten(dst)
+
+        assertEngineReusable()
+    }
+
+    // 中止后同一引擎照常出图
+    private fun assertEngineReusable() {
+        val dst = sentinelBitmap()
+        assertTrue(activity.runStyleTransfer(src, dst, 0, STEPS, FlowOptions()))
+        val pixels = IntArray(SIZE * SIZE)
+        dst.getPixels(pixels, 0, SIZE, 0, 0, SIZE, SIZE)
+        assertTrue(pixels.any { it != SENTINEL })
+    }
+
+    private fun waitJob(jobId: Int): IntArray {
+        val start = System.currentTimeMillis()
+        while (true) {
+            val info = activity.pollJob(jobId)
+            if (info[0] != JobState.QUEUED && info[0] != JobState.RUNNING) return info
+            assertTrue("job $jobId did not finish", System.currentTimeMillis() - start < TIMEOUT_MS)
+            Thread.sleep(10)
+        }
+    }
+
+    private fun sentinelBitmap(): Bitmap {
+        val bmp = Bitmap.createBitmap(SIZE, SIZE, Bitmap.Config.ARGB_8888)
+        bmp.eraseColor(SENTINEL)
+        return bmp
+    }
+
+    private fun assertUnwritten(bmp: Bitmap) {
+        val pixels = IntArray(SIZE * SIZE)
+        bmp.getPixels(pixels, 0, SIZE, 0, 0, SIZE, SIZE)
+        assertTrue("output bitmap was written", pixels.all { it == SENTINEL })
+    }
+
+    companion object {
+        private const val SIZE = 512
+        private const val STEPS = 20
+        private const val TIMEOUT_MS = 60_000L
+        private val SENTINEL = Color.argb(255, 255, 0, 255)
+    }
+}
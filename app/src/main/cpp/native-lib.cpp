@@ -2,23 +2,45 @@
 #include <string>
 #include <vector>
 #include <fstream>
+#include <sstream>
 #include <android/log.h>
 #include <android/bitmap.h>
 #include <chrono>
 #include <algorithm>
 #include <memory>
+#include <map>
 #include <ctime>
+#include <cmath>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <numeric>
+#include <sys/stat.h>
+#include <dirent.h>
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__AVX__) || defined(__SSE__)
+#include <immintrin.h>
+#endif
 
 #include <MNN/Interpreter.hpp>
 #include <MNN/MNNDefine.h>
 #include <MNN/ImageProcess.hpp>
+#include <MNN/expr/Module.hpp>
+#include <MNN/expr/ExprCreator.hpp>
+#include <MNN/expr/ExecutorScope.hpp>
 
 #define LOG_TAG "SAFlow_JNI"
 #define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
 
 using namespace MNN;
+using namespace MNN::Express;
 
 static std::string g_log_path = "";
+static std::mutex g_logMutex; // 保护 g_log_path 与日志文件写入 (会话池 / 流水线线程不持有引擎锁)
 
 // 日志工具：同时输出到 Logcat 和文件
 void WriteLog(const char* fmt, ...) {
@@ -28,205 +50,3824 @@ void WriteLog(const char* fmt, ...) {
 
     LOGI("%s", buf);
 
+    std::lock_guard<std::mutex> lock(g_logMutex);
     if (!g_log_path.empty()) {
         std::ofstream os(g_log_path, std::ios::app);
         if (os.is_open()) {
             time_t now = time(0);
-            tm *ltm = localtime(&now);
-            os << "[" << ltm->tm_hour << ":" << ltm->tm_min << ":" << ltm->tm_sec << "] " << buf << std::endl;
+            tm ltm;
+            localtime_r(&now, &ltm);
+            os << "[" << ltm.tm_hour << ":" << ltm.tm_min << ":" << ltm.tm_sec << "] " << buf << std::endl;
         }
     }
 }
 
-class SAFlowEngine {
+// 切换日志文件并清空旧内容
+static void SetLogPath(const std::string& path) {
+    std::lock_guard<std::mutex> lock(g_logMutex);
+    g_log_path = path;
+    std::ofstream(g_log_path, std::ios::trunc).close();
+}
+
+// Flow 积分器：与 Kotlin 端 FlowSolver 常量一一对应
+enum class FlowSolver {
+    Euler = 0,          // 一阶，每步 1 次 Flow
+    Heun = 1,           // 二阶（改进 Euler），每步 2 次 Flow
+    Midpoint = 2,       // 二阶中点法，每步 2 次 Flow
+    RK4 = 3,            // 经典四阶 Runge-Kutta，每步 4 次 Flow
+    AdamsBashforth = 4, // 三阶多步法，复用历史速度，每步 1 次 Flow
+    Adaptive = 5,       // Bogacki-Shampine 3(2) 自适应步长，误差估计控制 dt
+};
+
+static const char* solverName(FlowSolver s) {
+    switch (s) {
+        case FlowSolver::Heun: return "heun";
+        case FlowSolver::Midpoint: return "midpoint";
+        case FlowSolver::RK4: return "rk4";
+        case FlowSolver::AdamsBashforth: return "ab3";
+        case FlowSolver::Adaptive: return "bs23";
+        default: return "euler";
+    }
+}
+
+// 单次推理的参数（由 JNI 层从 Kotlin FlowOptions 读取）
+struct RunOptions {
+    int style = 0;
+    int steps = 4;                         // 决定积分终点 T = steps * 0.05
+    FlowSolver solver = FlowSolver::Euler;
+    int solverSteps = 0;                   // 积分区间数，<=0 时与 steps 相同
+    float tolerance = 1e-3f;               // Adaptive: 局部误差容限 (相对 + 绝对)
+    float earlyStop = 0.0f;                // 相对更新量 |Δx|/|x| 低于该值时提前结束，0 关闭
+    bool earlyStopMaxNorm = false;         // false: L2 范数；true: 最大值范数
+    bool nativeLayout = true;              // Flow 循环保持后端原生排布，探测不通过时自动回退 CAFFE
+    bool expressStep = false;              // Euler 用 Express Module (图内融合 x + v*dt)，不可用时回退 Interpreter
+    float reuseDrift = 0.0f;               // 速度复用的 latent 范数漂移阈值，0 关闭
+    int maxReuse = 1;                      // 最多连续复用次数
+    int unroll = 0;                        // Euler 每次 dispatch 展开的步数 (K 步一张图)，<=1 关闭
+    bool condCache = true;                 // x_cond / s 分支每图只算一次，Flow 图切不开时自动回退
+    bool styleGraph = false;               // 使用 s 固化为常量的风格特化 Flow 图 (首次使用时构建并缓存到磁盘)
+    bool timeTable = true;                 // 网格上的 t 直接使用加载时预先算好的时间嵌入
+    float guidance = 0.0f;                 // CFG 强度 w：v = v_u + w (v_c - v_u)，0 关闭
+    int nullStyle = -1;                    // 无条件分支使用的风格 id (训练时的 null style)，guidance > 0 时必须显式指定
+    int fp32Steps = 0;                     // 最后若干步改用 Precision_Normal 的 Flow Session，0 全程 FP16
+    int coarseSteps = 0;                   // 前若干步在半分辨率的 latent 上积分，再上采样回全分辨率，0 关闭
+    bool graphRender = true;               // 反归一化 / 截断 / uint8 RGBA 打包并入 Decoder 图，构建失败时回退主机循环
+    bool wholeGraph = false;               // Encoder → Flow×steps → Decoder 合成一个 Module 一次执行 (固定网格 Euler)
+    std::function<bool(int, int)> onStep;  // 每完成一步回调 (已完成步数, 总步数)，返回 false 取消本次推理
+    const std::atomic<bool>* cancelFlag = nullptr; // 置位后在下一个算子边界中止
+    float deadlineMs = 0.0f;               // 墙钟时间预算 (自开始计)，超出即在算子边界中止，0 不限
+    bool opCancel = true;                  // false 时取消 / 超时只在 Flow 步边界检查 (对比基准用)
+};
+
+// 单次推理的统计信息，通过 getLastRunStats 返回给 Kotlin
+struct RunStats {
+    FlowSolver solver = FlowSolver::Euler;
+    int steps = 0;        // 请求的步数（终点）
+    int solverSteps = 0;  // 实际积分区间数
+    int flowEvals = 0;    // Flow 网络调用次数 (runSession)
+    int reusedEvals = 0;  // 复用缓存速度而跳过的调用次数
+    int accepted = 0, rejected = 0; // Adaptive: 接受 / 拒绝的步数
+    int resumedFrom = 0;  // 从轨迹缓存的第几步继续 (0 表示完整计算)
+    int executedSteps = 0; // 实际执行到的步数 (提前结束时小于 solverSteps)
+    bool nativeLayout = false; // Flow 循环是否运行在后端原生排布上
+    bool expressStep = false;  // 是否走 Express 融合更新的 Module
+    int unroll = 0;            // K 步展开的 Module，0 表示未使用
+    int dispatches = 0;        // 展开路径的 Module 调用次数
+    bool condCache = false;    // 是否使用切分后的 condition 缓存
+    bool styleGraph = false;   // 是否使用风格特化的 Flow 图
+    float flopsSaved = 0;      // 相对完整 Flow 节省的计算量 (MFLOPs，已扣除 condition / 时间嵌入子网本身)
+    int tableHits = 0, tableMisses = 0; // 时间嵌入查表命中 / 现算次数
+    int batch = 1;             // 一次 Flow 循环同时处理的样本数
+    float queueMs = 0;         // 调度队列中的等待时间
+    float guidance = 0;        // CFG 强度，0 表示未使用
+    int fp16Steps = 0, fp32Steps = 0; // 精度调度：各精度下执行的步数 (未启用调度时均为 0)
+    int coarseSteps = 0;       // 在半分辨率 latent 上执行的步数
+    bool graphRender = false;  // 输出打包是否在 Decoder 图内完成
+    bool wholeGraph = false;   // 是否走整图流水线 Module
+    bool cancelled = false;    // 被取消 (executedSteps 为取消时已完成的步数)
+    bool deadlineExceeded = false; // 超出时间预算而中止
+    int poolSlot = -1;         // 会话池中使用的槽位，-1 表示未经会话池
+    float encMs = 0, flowMs = 0, decMs = 0, totalMs = 0;
+
+    std::string summary() const {
+        char buf[384];
+        int n = snprintf(buf, sizeof(buf), "solver=%s steps=%d/%d", solverName(solver), solverSteps, steps);
+        if (batch > 1) {
+            n += snprintf(buf + n, sizeof(buf) - n, " batch=%d", batch);
+        }
+        if (executedSteps < solverSteps) {
+            n += snprintf(buf + n, sizeof(buf) - n, " early_exit=%d", executedSteps);
+        }
+        n += snprintf(buf + n, sizeof(buf) - n, " evals=%d", flowEvals);
+        if (reusedEvals > 0) {
+            n += snprintf(buf + n, sizeof(buf) - n, " reused=%d", reusedEvals);
+        }
+        if (solver == FlowSolver::Adaptive) {
+            n += snprintf(buf + n, sizeof(buf) - n, " accepted=%d rejected=%d", accepted, rejected);
+        }
+        if (resumedFrom > 0) {
+            n += snprintf(buf + n, sizeof(buf) - n, " resumed=%d", resumedFrom);
+        }
+        if (nativeLayout) {
+            n += snprintf(buf + n, sizeof(buf) - n, " native");
+        }
+        if (expressStep) {
+            n += snprintf(buf + n, sizeof(buf) - n, " express");
+        }
+        if (unroll > 0) {
+            n += snprintf(buf + n, sizeof(buf) - n, " unroll=%d dispatches=%d", unroll, dispatches);
+        }
+        if (condCache) {
+            n += snprintf(buf + n, sizeof(buf) - n, " cond_cache");
+        }
+        if (styleGraph) {
+            n += snprintf(buf + n, sizeof(buf) - n, " style_graph");
+        }
+        if (tableHits + tableMisses > 0) {
+            n += snprintf(buf + n, sizeof(buf) - n, " temb_table=%d/%d", tableHits, tableHits + tableMisses);
+        }
+        if (condCache || styleGraph) {
+            n += snprintf(buf + n, sizeof(buf) - n, " saved=%.1fMFLOPs", flopsSaved);
+        }
+        if (guidance > 0) {
+            n += snprintf(buf + n, sizeof(buf) - n, " cfg=%.2f", guidance);
+        }
+        if (fp32Steps > 0) {
+            n += snprintf(buf + n, sizeof(buf) - n, " precision=fp16x%d+fp32x%d", fp16Steps, fp32Steps);
+        }
+        if (coarseSteps > 0) {
+            n += snprintf(buf + n, sizeof(buf) - n, " coarse=%d", coarseSteps);
+        }
+        if (graphRender) {
+            n += snprintf(buf + n, sizeof(buf) - n, " graph_render");
+        }
+        if (wholeGraph) {
+            n += snprintf(buf + n, sizeof(buf) - n, " whole_graph");
+        }
+        if (cancelled) {
+            n += snprintf(buf + n, sizeof(buf) - n, " cancelled_at=%d", executedSteps);
+        }
+        if (deadlineExceeded) {
+            n += snprintf(buf + n, sizeof(buf) - n, " deadline_at=%d", executedSteps);
+        }
+        if (poolSlot >= 0) {
+            n += snprintf(buf + n, sizeof(buf) - n, " pool_slot=%d", poolSlot);
+        }
+        if (queueMs > 0) {
+            n += snprintf(buf + n, sizeof(buf) - n, " queue=%.1fms", queueMs);
+        }
+        snprintf(buf + n, sizeof(buf) - n, " enc=%.1fms flow=%.1fms dec=%.1fms total=%.1fms", encMs, flowMs, decMs, totalMs);
+        return buf;
+    }
+};
+
+static float elapsedMs(std::chrono::high_resolution_clock::time_point since) {
+    return std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - since).count();
+}
+
+// FNV-1a 64 位哈希，用于识别输入图像 / 模型文件
+static uint64_t fnv1a(const uint8_t* data, size_t len, uint64_t h = 1469598103934665603ULL) {
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ data[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// 模型文件指纹 (大小 + 修改时间)，上传新模型后自动变化
+static uint64_t fileFingerprint(const std::string& file) {
+    struct stat st;
+    if (stat(file.c_str(), &st) != 0) return 0;
+    uint64_t v[2] = {(uint64_t)st.st_size, (uint64_t)st.st_mtime};
+    return fnv1a((const uint8_t*)v, sizeof(v));
+}
+
+// out = x + a * v （out 可与 x 相同），Flow 每步的核心更新，按平台做 SIMD
+static void axpy(float* out, const float* x, float a, const float* v, int n) {
+    int j = 0;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    float32x4_t va = vdupq_n_f32(a);
+    for (; j + 16 <= n; j += 16) {
+        float32x4_t x0 = vld1q_f32(x + j), x1 = vld1q_f32(x + j + 4);
+        float32x4_t x2 = vld1q_f32(x + j + 8), x3 = vld1q_f32(x + j + 12);
+#if defined(__aarch64__)
+        x0 = vfmaq_f32(x0, vld1q_f32(v + j), va);
+        x1 = vfmaq_f32(x1, vld1q_f32(v + j + 4), va);
+        x2 = vfmaq_f32(x2, vld1q_f32(v + j + 8), va);
+        x3 = vfmaq_f32(x3, vld1q_f32(v + j + 12), va);
+#else
+        x0 = vmlaq_f32(x0, vld1q_f32(v + j), va);
+        x1 = vmlaq_f32(x1, vld1q_f32(v + j + 4), va);
+        x2 = vmlaq_f32(x2, vld1q_f32(v + j + 8), va);
+        x3 = vmlaq_f32(x3, vld1q_f32(v + j + 12), va);
+#endif
+        vst1q_f32(out + j, x0);
+        vst1q_f32(out + j + 4, x1);
+        vst1q_f32(out + j + 8, x2);
+        vst1q_f32(out + j + 12, x3);
+    }
+#elif defined(__AVX__)
+    __m256 va = _mm256_set1_ps(a);
+    for (; j + 16 <= n; j += 16) {
+        __m256 v0 = _mm256_mul_ps(_mm256_loadu_ps(v + j), va);
+        __m256 v1 = _mm256_mul_ps(_mm256_loadu_ps(v + j + 8), va);
+        _mm256_storeu_ps(out + j, _mm256_add_ps(_mm256_loadu_ps(x + j), v0));
+        _mm256_storeu_ps(out + j + 8, _mm256_add_ps(_mm256_loadu_ps(x + j + 8), v1));
+    }
+#elif defined(__SSE__)
+    __m128 va = _mm_set1_ps(a);
+    for (; j + 8 <= n; j += 8) {
+        __m128 v0 = _mm_mul_ps(_mm_loadu_ps(v + j), va);
+        __m128 v1 = _mm_mul_ps(_mm_loadu_ps(v + j + 4), va);
+        _mm_storeu_ps(out + j, _mm_add_ps(_mm_loadu_ps(x + j), v0));
+        _mm_storeu_ps(out + j + 4, _mm_add_ps(_mm_loadu_ps(x + j + 4), v1));
+    }
+#endif
+    for (; j < n; j++) {
+        out[j] = x[j] + a * v[j];
+    }
+}
+
+// CFG 合成与 Euler 更新融合为一次遍历：x += h * (vu + w * (vc - vu))
+// 只有 Euler 能融合；其余求解器需要合成后的速度本身，由 FlowField::eval 单独合成一遍
+static void guidedAxpy(float* x, float h, float w, const float* vc, const float* vu, int n) {
+    int j = 0;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    float32x4_t vh = vdupq_n_f32(h), vw = vdupq_n_f32(w);
+    for (; j + 4 <= n; j += 4) {
+        float32x4_t u = vld1q_f32(vu + j);
+        float32x4_t g = vmlaq_f32(u, vsubq_f32(vld1q_f32(vc + j), u), vw);
+        vst1q_f32(x + j, vmlaq_f32(vld1q_f32(x + j), g, vh));
+    }
+#elif defined(__AVX__)
+    __m256 vh = _mm256_set1_ps(h), vw = _mm256_set1_ps(w);
+    for (; j + 8 <= n; j += 8) {
+        __m256 u = _mm256_loadu_ps(vu + j);
+        __m256 g = _mm256_add_ps(u, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(vc + j), u), vw));
+        _mm256_storeu_ps(x + j, _mm256_add_ps(_mm256_loadu_ps(x + j), _mm256_mul_ps(g, vh)));
+    }
+#elif defined(__SSE__)
+    __m128 vh = _mm_set1_ps(h), vw = _mm_set1_ps(w);
+    for (; j + 4 <= n; j += 4) {
+        __m128 u = _mm_loadu_ps(vu + j);
+        __m128 g = _mm_add_ps(u, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(vc + j), u), vw));
+        _mm_storeu_ps(x + j, _mm_add_ps(_mm_loadu_ps(x + j), _mm_mul_ps(g, vh)));
+    }
+#endif
+    for (; j < n; j++) {
+        x[j] += h * (vu[j] + w * (vc[j] - vu[j]));
+    }
+}
+
+// 2x2 平均下采样，CAFFE 排布 [c, h, w] -> [c, h/2, w/2]
+static void downsample2x(const float* src, float* dst, int c, int h, int w) {
+    const int oh = h / 2, ow = w / 2;
+    for (int k = 0; k < c; k++) {
+        const float* s = src + k * h * w;
+        float* d = dst + k * oh * ow;
+        for (int y = 0; y < oh; y++) {
+            for (int x = 0; x < ow; x++) {
+                const float* p = s + (2 * y) * w + 2 * x;
+                d[y * ow + x] = 0.25f * (p[0] + p[1] + p[w] + p[w + 1]);
+            }
+        }
+    }
+}
+
+// 双线性 2 倍上采样并累加：dst [c, 2h, 2w] += up(src [c, h, w])
+static void upsample2xAdd(const float* src, float* dst, int c, int h, int w) {
+    const int oh = h * 2, ow = w * 2;
+    for (int k = 0; k < c; k++) {
+        const float* s = src + k * h * w;
+        float* d = dst + k * oh * ow;
+        for (int y = 0; y < oh; y++) {
+            float sy = std::max(0.0f, (y + 0.5f) * 0.5f - 0.5f);
+            int y0 = std::min((int)sy, h - 1), y1 = std::min(y0 + 1, h - 1);
+            float fy = sy - (float)y0;
+            for (int x = 0; x < ow; x++) {
+                float sx = std::max(0.0f, (x + 0.5f) * 0.5f - 0.5f);
+                int x0 = std::min((int)sx, w - 1), x1 = std::min(x0 + 1, w - 1);
+                float fx = sx - (float)x0;
+                float top = s[y0 * w + x0] + fx * (s[y0 * w + x1] - s[y0 * w + x0]);
+                float bot = s[y1 * w + x0] + fx * (s[y1 * w + x1] - s[y1 * w + x0]);
+                d[y * ow + x] += top + fy * (bot - top);
+            }
+        }
+    }
+}
+
+// 相对更新量 |x - prev| / |x|，用于判断 Flow 是否已收敛
+static float relativeUpdate(const float* prev, const float* x, int n, bool maxNorm) {
+    if (maxNorm) {
+        float d = 0.0f, m = 0.0f;
+        for (int j = 0; j < n; j++) {
+            d = std::max(d, std::fabs(x[j] - prev[j]));
+            m = std::max(m, std::fabs(x[j]));
+        }
+        return d / std::max(m, 1e-12f);
+    }
+    double d = 0.0, m = 0.0;
+    for (int j = 0; j < n; j++) {
+        float e = x[j] - prev[j];
+        d += (double)e * e;
+        m += (double)x[j] * x[j];
+    }
+    return (float)std::sqrt(d / std::max(m, 1e-24));
+}
+
+// Flow 模型的输入 / 输出绑定：按名字优先，缺失时按形状与类型推断角色
+// latent 形状的 float 输入为 x_t / x_cond (名字含 "cond" 的为条件)，单元素 float 为 t，int 为风格 id
+struct FlowSignature {
+    std::string xt = "x_t", cond = "x_cond", t = "t", s = "s", out = "output"; // 为空表示模型没有该输入
+    int size = 4 * 64 * 64; // latent 元素数 (batch 1)
+
+    // 与引擎内各派生图 (切分 / 展开 / 风格特化 / 整图) 假定的结构一致
+    bool canonical() const {
+        return xt == "x_t" && cond == "x_cond" && t == "t" && s == "s" && out == "output" && size == 4 * 64 * 64;
+    }
+};
+
+static FlowSignature inspectFlowSignature(Interpreter* net, Session* sess) {
+    FlowSignature sig;
+    const auto& outputs = net->getSessionOutputAll(sess);
+    if (!outputs.count(sig.out) && !outputs.empty()) {
+        sig.out = outputs.begin()->first;
+    }
+    sig.size = outputs.empty() ? 0 : outputs.at(sig.out)->elementSize();
+    const auto& inputs = net->getSessionInputAll(sess);
+    // 整型输入只有单元素、且名字不像时间 / 步号 (蒸馏模型的整型 timestep) 时才作为风格 id 候选
+    auto timeLike = [](const std::string& name) {
+        return name == "t" || name.find("time") != std::string::npos || name.find("step") != std::string::npos;
+    };
+    std::vector<std::string> latents, scalars, ints;
+    for (const auto& kv : inputs) {
+        const Tensor* tensor = kv.second;
+        if (tensor->getType().code == halide_type_int) {
+            if (tensor->elementSize() == 1 && !timeLike(kv.first)) ints.push_back(kv.first);
+        } else if (tensor->elementSize() == sig.size) {
+            latents.push_back(kv.first);
+        } else if (tensor->elementSize() == 1) {
+            scalars.push_back(kv.first);
+        }
+    }
+    auto pick = [&](std::string& role, std::vector<std::string>& pool, const char* hint) {
+        if (inputs.count(role)) {
+            pool.erase(std::remove(pool.begin(), pool.end(), role), pool.end());
+            return;
+        }
+        role.clear();
+        for (auto it = pool.begin(); it != pool.end(); ++it) {
+            if (!hint || it->find(hint) != std::string::npos) {
+                role = *it;
+                pool.erase(it);
+                return;
+            }
+        }
+    };
+    pick(sig.cond, latents, "cond");
+    pick(sig.xt, latents, nullptr);
+    pick(sig.t, scalars, nullptr);
+    // 多个整型候选时只接受名字含 "style" 的那个
+    pick(sig.s, ints, ints.size() == 1 ? nullptr : "style");
+    for (const auto& kv : inputs) {
+        if (kv.first != sig.xt && kv.first != sig.cond && kv.first != sig.t && kv.first != sig.s) {
+            WriteLog("⚠️ Flow input '%s' matches no role and is left unset", kv.first.c_str());
+        }
+    }
+    WriteLog("Flow signature: x_t='%s' x_cond='%s' t='%s' s='%s' output='%s' latent=%d%s",
+             sig.xt.c_str(), sig.cond.c_str(), sig.t.c_str(), sig.s.c_str(), sig.out.c_str(), sig.size,
+             sig.canonical() ? "" : " (non-canonical, derived graphs disabled)");
+    return sig;
+}
+
+// Flow.mnn 旁的可选调度描述 Flow.schedule，每行 key=value，# 开头为注释：
+//   steps=2              固定步数 (蒸馏模型按训练时的步数运行，忽略界面上的步数)
+//   dt=0.5               均匀网格的步长 (默认 0.05)
+//   timesteps=0,0.7,1.0  非均匀网格的各区间端点，n+1 个点对应 n 步，给出时 steps / dt 不再生效
+struct FlowSchedule {
+    int steps = 0;
+    float dt = 0.05f;
+    std::vector<float> timesteps;
+    bool loaded = false;
+};
+
+static FlowSchedule loadFlowSchedule(const std::string& file) {
+    FlowSchedule sc;
+    std::ifstream in(file);
+    if (!in) return sc;
+    std::string line;
+    while (std::getline(in, line)) {
+        auto eq = line.find('=');
+        if (line.empty() || line[0] == '#' || eq == std::string::npos) continue;
+        std::string key = line.substr(0, eq);
+        std::string value = line.substr(eq + 1);
+        key.erase(std::remove_if(key.begin(), key.end(), ::isspace), key.end());
+        if (key == "steps") {
+            // 与 runPixels 对 opts.steps 的限制一致：1 ~ 50，0 或缺省表示沿用请求的步数
+            int steps = atoi(value.c_str());
+            sc.steps = steps > 0 ? std::min(steps, 50) : 0;
+            if (sc.steps != steps && steps > 0) {
+                WriteLog("⚠️ Flow.schedule: steps=%d clamped to %d", steps, sc.steps);
+            }
+        } else if (key == "dt") {
+            sc.dt = std::max(1e-4f, (float)atof(value.c_str()));
+        } else if (key == "timesteps") {
+            std::stringstream ss(value);
+            std::string item;
+            while (std::getline(ss, item, ',')) {
+                sc.timesteps.push_back((float)atof(item.c_str()));
+            }
+        } else {
+            WriteLog("⚠️ Flow.schedule: unknown key '%s'", key.c_str());
+        }
+    }
+    if (sc.timesteps.size() == 1) {
+        WriteLog("⚠️ Flow.schedule: timesteps needs at least two points, ignored");
+        sc.timesteps.clear();
+    }
+    for (size_t i = 1; i < sc.timesteps.size(); i++) {
+        if (!(sc.timesteps[i] > sc.timesteps[i - 1])) {
+            WriteLog("⚠️ Flow.schedule: timesteps not strictly increasing at %d (%.4f -> %.4f), ignored",
+                     (int)i, sc.timesteps[i - 1], sc.timesteps[i]);
+            sc.timesteps.clear();
+            break;
+        }
+    }
+    if (sc.timesteps.size() > 51) {
+        WriteLog("⚠️ Flow.schedule: %d timesteps exceed the 50-step limit, ignored", (int)sc.timesteps.size());
+        sc.timesteps.clear();
+    }
+    if (!sc.timesteps.empty()) {
+        sc.steps = (int)sc.timesteps.size() - 1;
+    }
+    sc.loaded = true;
+    WriteLog("Flow.schedule: steps=%d dt=%.3f timesteps=%d", sc.steps, sc.dt, (int)sc.timesteps.size());
+    return sc;
+}
+
+// 单次推理的中止条件：取消标志与墙钟截止时间
+struct RunGuard {
+    enum Reason { None = 0, Cancelled = 1, Deadline = 2 };
+    const std::atomic<bool>* cancel = nullptr;
+    bool hasDeadline = false;
+    std::chrono::steady_clock::time_point deadline;
+    Reason reason = None;
+    int aborts = 0; // 中途停下的 runSession 次数 (该次输出不完整)
+
+    bool active() const { return cancel || hasDeadline; }
+    bool check() {
+        if (reason == None && cancel && cancel->load(std::memory_order_relaxed)) {
+            reason = Cancelled;
+        } else if (reason == None && hasDeadline && std::chrono::steady_clock::now() >= deadline) {
+            reason = Deadline;
+        }
+        return reason != None;
+    }
+};
+
+// 当前线程正在执行的推理的 RunGuard，由 RunGuardScope 设置
+static thread_local RunGuard* t_runGuard = nullptr;
+
+struct RunGuardScope {
+    RunGuard* prev;
+    explicit RunGuardScope(RunGuard* g) : prev(t_runGuard) { t_runGuard = g; }
+    ~RunGuardScope() { t_runGuard = prev; }
+};
+
+// 带中止检查的 runSession：当前线程有 RunGuard 时逐算子检查，中止后其余算子全部跳过，
+// 以 CALL_BACK_STOP 返回；Session 状态不受影响，下次照常运行。被中止时返回 false
+static bool runChecked(Interpreter* net, Session* sess) {
+    RunGuard* g = t_runGuard;
+    if (!g || !g->active()) {
+        net->runSession(sess);
+        return true;
+    }
+    if (g->check()) return false;
+    auto check = [g](const std::vector<Tensor*>&, const std::string&) { return !g->check(); };
+    net->runSessionWithCallBack(sess, check, check, true);
+    if (g->reason != RunGuard::None) {
+        g->aborts++;
+        return false;
+    }
+    return true;
+}
+
+// Flow 网络封装为速度场 v = f(x, t)，负责 Host <-> Session 的数据搬运与调用计数
+// CPU 后端 FP32 且无 padding 的张量可以直接读写 Session 内存（构造时与首次调用时探测）：
+// - CAFFE 排布：x_t 的写入与 output 的读取都不再经过 host 张量
+// - native 模式：latent / 速度 / 更新全程保持后端原生排布 (如 NC4HW4)，逐元素运算与排布无关，
+//   只在首尾通过 importCaffe / exportCaffe 做一次置换
+class FlowField {
 public:
-    std::unique_ptr<Interpreter> netEnc, netFlow, netDec;
-    Session *sessEnc = nullptr, *sessFlow = nullptr, *sessDec = nullptr;
-    std::shared_ptr<CV::ImageProcess> imgProc;
+    FlowField(Interpreter* net, Session* sess, int size, bool native = false,
+              const FlowSignature& sig = FlowSignature()) : mNet(net), mSess(sess), mSize(size) {
+        mXt = net->getSessionInput(sess, sig.xt.c_str());
+        // 时间嵌入查表的切分图里 t 可能已不再是输入
+        const auto& inputs = net->getSessionInputAll(sess);
+        mT = inputs.count(sig.t) ? inputs.at(sig.t) : nullptr;
+        mOut = net->getSessionOutput(sess, sig.out.c_str());
+        hXt.reset(new Tensor(mXt, Tensor::CAFFE));
+        if (mT) {
+            hT.reset(new Tensor(mT, Tensor::CAFFE));
+        }
+        hV.reset(new Tensor(mOut, Tensor::CAFFE));
+
+        // 探测：写入 0..n-1 后读 Session 原始内存，若恰好是这些值的一个排列，
+        // 说明存储为 FP32 且无 padding，mPerm[k] 即原始位置 k 对应的 CAFFE 下标
+        float* probe = hXt->host<float>();
+        for (int j = 0; j < mSize; j++) {
+            probe[j] = (float)j;
+        }
+        mXt->copyFromHostTensor(hXt.get());
+        const float* raw = mXt->host<float>();
+        if (raw && mXt->size() == mSize * (int)sizeof(float)) {
+            std::vector<char> seen(mSize, 0);
+            mPerm.resize(mSize);
+            bool identity = true;
+            for (int k = 0; k < mSize && !mPerm.empty(); k++) {
+                int j = (int)raw[k];
+                if ((float)j != raw[k] || j < 0 || j >= mSize || seen[j]) {
+                    mPerm.clear();
+                    break;
+                }
+                seen[j] = 1;
+                mPerm[k] = j;
+                identity = identity && j == k;
+            }
+            mDirectIn = !mPerm.empty() && (identity || native);
+            mNative = mDirectIn && !identity;
+        }
+        if (!mNative) {
+            mPerm.clear();
+        } else {
+            mVNative.resize(mSize);
+        }
+    }
+
+    // 速度复用：相邻两步之间，距上一步起点的 latent 范数相对变化低于 drift 时直接复用最近一次的速度，
+    // 连续复用不超过 maxSkips 次。只在 beginStep 标记的每步第一个阶段判断，多阶段方法的中间阶段总是真实调用
+    void setReuse(float drift, int maxSkips) {
+        mReuseDrift = drift;
+        mMaxSkips = std::max(0, maxSkips);
+    }
+
+    // 下一次 eval 是新一步的第一个阶段 (由积分器在每步开始时调用)
+    void beginStep() { mStepStart = true; }
+
+    // CFG：Session 为 batch 2，样本 0 为条件分支、样本 1 为无条件 (null style) 分支，
+    // 两个分支同一次 runSession 完成，eval 返回合成后的速度 vu + w * (vc - vu)
+    void setGuidance(float w) {
+        mGuidance = w;
+        mVGuided.resize(mSize);
+    }
+
+    // 一步 Euler：x += h * v；CFG 模式下合成与更新在同一次遍历内完成
+    void eulerStep(float* x, float t, float h) {
+        if (mGuidance > 0.0f) {
+            const float* v = runGuided(x, t);
+            if (!aborted) guidedAxpy(x, h, mGuidance, v, v + mSize, mSize);
+        } else {
+            const float* v = eval(x, t);
+            if (!aborted) axpy(x, x, h, v, mSize);
+        }
+    }
+
+    // t 以外的时间输入 (如预先算好的时间嵌入)，每次真实调用前按 t 写入
+    void setTimeFeed(std::function<void(float)> feed) {
+        mTimeFeed = std::move(feed);
+    }
+
+    // x_t 与 output 都能直接访问（output 在首次 eval 后才能判定）
+    bool direct() const { return mDirectIn && mDirectOut; }
+    // latent 状态是否使用后端原生排布
+    bool nativeLayout() const { return mNative; }
+
+    // CAFFE 排布 <-> 状态排布（非 native 模式下就是拷贝）
+    void importCaffe(const float* caffe, float* x) const {
+        if (!mNative) {
+            memcpy(x, caffe, mSize * sizeof(float));
+            return;
+        }
+        for (int k = 0; k < mSize; k++) {
+            x[k] = caffe[mPerm[k]];
+        }
+    }
+    void exportCaffe(const float* x, float* caffe) const {
+        if (!mNative) {
+            memcpy(caffe, x, mSize * sizeof(float));
+            return;
+        }
+        for (int k = 0; k < mSize; k++) {
+            caffe[mPerm[k]] = x[k];
+        }
+    }
+
+    // x_t 的 Session 内存可直接读写时返回其指针，latent 可原地存放在这里
+    float* directInput() const {
+        return mDirectIn ? mXt->host<float>() : nullptr;
+    }
+
+    // x 与返回的速度均为状态排布，返回指针在下一次 eval 之前有效
+    // Flow 调用被中止后 aborted 置位，返回的速度不完整，调用方不能再用它更新状态；之后的调用不再执行
+    const float* eval(const float* x, float t) {
+        if (aborted) {
+            return hV->host<float>();
+        }
+        if (mGuidance > 0.0f) {
+            // 非 Euler 求解器：合成单独一遍写入 mVGuided，不与更新融合 (Euler 走 eulerStep 的 guidedAxpy)
+            const float* v = runGuided(x, t);
+            for (int j = 0; j < mSize; j++) {
+                mVGuided[j] = v[mSize + j] + mGuidance * (v[j] - v[mSize + j]);
+            }
+            return mVGuided.data();
+        }
+        const bool stepStart = mStepStart;
+        mStepStart = false;
+        if (mReuseDrift > 0.0f && stepStart) {
+            double sq = 0.0;
+            for (int j = 0; j < mSize; j++) {
+                sq += (double)x[j] * x[j];
+            }
+            float norm = (float)std::sqrt(sq);
+            if (evals > 0 && mSkips < mMaxSkips &&
+                std::fabs(norm - mLastNorm) <= mReuseDrift * std::max(mLastNorm, 1e-12f)) {
+                // mV 仍指向上次真实调用的输出
+                mSkips++;
+                skipped++;
+                return mV;
+            }
+            mLastNorm = norm;
+            mSkips = 0;
+        }
+
+        if (mDirectIn) {
+            if (x != mXt->host<float>()) {
+                memcpy(mXt->host<float>(), x, mSize * sizeof(float));
+            }
+        } else {
+            memcpy(hXt->host<float>(), x, mSize * sizeof(float));
+            mXt->copyFromHostTensor(hXt.get());
+        }
+
+        if (mT) {
+            // batch 化的 Session 中 t 的每个样本取同一时刻
+            std::fill(hT->host<float>(), hT->host<float>() + hT->elementSize(), t);
+            mT->copyFromHostTensor(hT.get());
+        }
+        if (mTimeFeed) {
+            mTimeFeed(t);
+        }
+
+        if (!runChecked(mNet, mSess)) {
+            aborted = true;
+            return hV->host<float>();
+        }
+        evals++;
+
+        if (mDirectOut) {
+            mV = mOut->host<float>();
+        } else {
+            mOut->copyToHostTensor(hV.get());
+            if (mNative) {
+                importCaffe(hV->host<float>(), mVNative.data());
+                mV = mVNative.data();
+            } else {
+                mV = hV->host<float>();
+            }
+            // 探测：output 原始内存与状态排布的速度一致时，之后直接读取
+            if (evals == 1) {
+                mDirectOut = mOut->host<float>() != nullptr && mOut->size() == mSize * (int)sizeof(float) &&
+                             memcmp(mOut->host<float>(), mV, mSize * sizeof(float)) == 0;
+            }
+        }
+        return mV;
+    }
+
+    int size() const { return mSize; }
+    int evals = 0;    // 真实 Flow 调用次数 (CFG 的两个分支合计一次)
+    int skipped = 0;  // 复用缓存速度、跳过的调用次数
+    bool aborted = false; // 有 Flow 调用被 RunGuard 中途停下
+
+private:
+    Interpreter* mNet;
+    Session* mSess;
+    int mSize;
+    bool mDirectIn = false, mDirectOut = false, mNative = false;
+    std::vector<int> mPerm;          // native 模式：原始位置 -> CAFFE 下标
+    std::vector<float> mVNative;     // native 模式且 output 不可直接读取时的速度缓冲
+    const float* mV = nullptr;
+    float mReuseDrift = 0.0f, mLastNorm = 0.0f;
+    int mMaxSkips = 0, mSkips = 0;
+    bool mStepStart = false;
+    Tensor *mXt, *mT, *mOut;
+    std::unique_ptr<Tensor> hXt, hT, hV;
+    std::function<void(float)> mTimeFeed;
+    float mGuidance = 0.0f;
+    std::vector<float> mVGuided;
+
+    // CFG：同一个 x 写入两个样本，返回 [vc | vu] 的 CAFFE 排布速度
+    const float* runGuided(const float* x, float t) {
+        memcpy(hXt->host<float>(), x, mSize * sizeof(float));
+        memcpy(hXt->host<float>() + mSize, x, mSize * sizeof(float));
+        mXt->copyFromHostTensor(hXt.get());
+        if (mT) {
+            std::fill(hT->host<float>(), hT->host<float>() + hT->elementSize(), t);
+            mT->copyFromHostTensor(hT.get());
+        }
+        if (!runChecked(mNet, mSess)) {
+            aborted = true;
+            return hV->host<float>();
+        }
+        evals++;
+        mOut->copyToHostTensor(hV.get());
+        return hV->host<float>();
+    }
+};
+
+// 在 [t0, t0 + n*h] 上积分 dx/dt = f(x, t)，x 原地更新
+// earlyStop > 0 时，单步相对更新量低于阈值即停止，返回实际执行的步数
+// onStep 在每步结束时以本段已完成的步数调用，返回 false 时立即停止 (取消)
+// Flow 调用被中止 (f.aborted) 时当前步不更新 x，立即返回已完成的步数
+// 多阶段方法的中间速度需要拷贝保存；Euler 直接用 Flow 输出做一次融合更新
+static int integrateFlow(FlowField& f, float* x, float t0, float h, int n, FlowSolver solver,
+                         float earlyStop = 0.0f, bool maxNorm = false,
+                         const std::function<bool(int)>& onStep = nullptr) {
+    const int size = f.size();
+    std::vector<float> k1, k2, k3, tmp, prev;
+    if (earlyStop > 0.0f) {
+        prev.resize(size);
+    }
+    if (solver != FlowSolver::Euler) {
+        k1.resize(size);
+        tmp.resize(size);
+    }
+    if (solver == FlowSolver::RK4 || solver == FlowSolver::AdamsBashforth) {
+        k2.resize(size);
+        k3.resize(size);
+    }
+    const size_t bytes = size * sizeof(float);
+
+    for (int i = 0; i < n; i++) {
+        float t = t0 + (float)i * h;
+        f.beginStep();
+        if (!prev.empty()) {
+            memcpy(prev.data(), x, bytes);
+        }
+        switch (solver) {
+            case FlowSolver::Heun: {
+                memcpy(k1.data(), f.eval(x, t), bytes);
+                axpy(tmp.data(), x, h, k1.data(), size);
+                const float* v2 = f.eval(tmp.data(), t + h);
+                if (f.aborted) break;
+                for (int j = 0; j < size; j++) {
+                    x[j] += 0.5f * h * (k1[j] + v2[j]);
+                }
+                break;
+            }
+            case FlowSolver::Midpoint: {
+                axpy(tmp.data(), x, 0.5f * h, f.eval(x, t), size);
+                const float* v2 = f.eval(tmp.data(), t + 0.5f * h);
+                if (f.aborted) break;
+                axpy(x, x, h, v2, size);
+                break;
+            }
+            case FlowSolver::RK4: {
+                memcpy(k1.data(), f.eval(x, t), bytes);
+                axpy(tmp.data(), x, 0.5f * h, k1.data(), size);
+                memcpy(k2.data(), f.eval(tmp.data(), t + 0.5f * h), bytes);
+                axpy(tmp.data(), x, 0.5f * h, k2.data(), size);
+                memcpy(k3.data(), f.eval(tmp.data(), t + 0.5f * h), bytes);
+                axpy(tmp.data(), x, h, k3.data(), size);
+                const float* k4 = f.eval(tmp.data(), t + h);
+                if (f.aborted) break;
+                for (int j = 0; j < size; j++) {
+                    x[j] += h / 6.0f * (k1[j] + 2.0f * k2[j] + 2.0f * k3[j] + k4[j]);
+                }
+                break;
+            }
+            case FlowSolver::AdamsBashforth: {
+                // k1 = f_n, k2 = f_{n-1}, k3 = f_{n-2}；前两步依次退化为 Euler / AB2
+                std::swap(k3, k2);
+                std::swap(k2, k1);
+                memcpy(k1.data(), f.eval(x, t), bytes);
+                if (f.aborted) break;
+                if (i == 0) {
+                    axpy(x, x, h, k1.data(), size);
+                } else if (i == 1) {
+                    for (int j = 0; j < size; j++) {
+                        x[j] += h * (1.5f * k1[j] - 0.5f * k2[j]);
+                    }
+                } else {
+                    for (int j = 0; j < size; j++) {
+                        x[j] += h / 12.0f * (23.0f * k1[j] - 16.0f * k2[j] + 5.0f * k3[j]);
+                    }
+                }
+                break;
+            }
+            default:
+                f.eulerStep(x, t, h);
+                break;
+        }
+        if (f.aborted) {
+            return i;
+        }
+        if (!prev.empty() && relativeUpdate(prev.data(), x, size, maxNorm) < earlyStop) {
+            return i + 1;
+        }
+        if (onStep && !onStep(i + 1)) {
+            return i + 1;
+        }
+    }
+    return n;
+}
+
+// Bogacki-Shampine 3(2) 嵌入式积分：用 3 阶/2 阶解之差估计局部误差，自动放大或缩小 dt
+// 首个速度在接受后复用 (FSAL)，因此每个接受步只需 3 次 Flow；不做速度复用 (会让误差估计恒为 0)
+// onStep 在每次尝试 (接受或拒绝) 之后以已接受的步数调用，拒绝步上也能及时取消；Flow 调用被中止时立即返回
+static void integrateAdaptive(FlowField& f, float* x, float t0, float T, float h0, float tol, RunStats& stats,
+                              const std::function<bool(int)>& onStep = nullptr) {
+    const int size = f.size();
+    const size_t bytes = size * sizeof(float);
+    const int max_evals = 200;      // 防止容限过小时无限细分
+    const float min_h = 1e-4f;
+    std::vector<float> k1(size), k2(size), k3(size), tmp(size), xNew(size);
+
+    float t = t0;
+    float h = std::min(h0, T - t0);
+    memcpy(k1.data(), f.eval(x, t), bytes);
+    while (T - t > 1e-6f && f.evals < max_evals && !f.aborted) {
+        h = std::min(h, T - t);
+        axpy(tmp.data(), x, 0.5f * h, k1.data(), size);
+        memcpy(k2.data(), f.eval(tmp.data(), t + 0.5f * h), bytes);
+        axpy(tmp.data(), x, 0.75f * h, k2.data(), size);
+        memcpy(k3.data(), f.eval(tmp.data(), t + 0.75f * h), bytes);
+        for (int j = 0; j < size; j++) {
+            xNew[j] = x[j] + h * (2.0f / 9.0f * k1[j] + 1.0f / 3.0f * k2[j] + 4.0f / 9.0f * k3[j]);
+        }
+        const float* k4 = f.eval(xNew.data(), t + h);
+        if (f.aborted) {
+            return;
+        }
+
+        // 误差范数：RMS( e_j / (tol + tol * |x_j|) )
+        double acc = 0.0;
+        for (int j = 0; j < size; j++) {
+            float e = h * (-5.0f / 72.0f * k1[j] + 1.0f / 12.0f * k2[j] + 1.0f / 9.0f * k3[j] - 0.125f * k4[j]);
+            float sc = tol + tol * std::max(std::fabs(x[j]), std::fabs(xNew[j]));
+            acc += (double)(e / sc) * (e / sc);
+        }
+        float err = (float)std::sqrt(acc / size);
+
+        if (err <= 1.0f || h <= min_h) {
+            t += h;
+            memcpy(x, xNew.data(), bytes);
+            memcpy(k1.data(), k4, bytes);
+            stats.accepted++;
+        } else {
+            stats.rejected++;
+        }
+        if (onStep && !onStep(stats.accepted)) {
+            return;
+        }
+        // 三阶方法的步长控制：h *= 0.9 * err^(-1/3)，单步缩放限制在 [0.2, 5]
+        float factor = err > 0.0f ? 0.9f * std::pow(err, -1.0f / 3.0f) : 5.0f;
+        h = std::max(min_h, h * std::max(0.2f, std::min(5.0f, factor)));
+    }
+    if (T - t > 1e-6f && !f.aborted) {
+        WriteLog("⚠️ Adaptive: eval budget exhausted at t=%.3f / %.3f", t, T);
+    }
+}
+
+// 按 Module 记录的输入信息创建输入变量，data 一律是 CAFFE (NCHW) 排布；类型与输入不同时在图内转换
+template <typename T>
+static VARP makeModuleInput(const Variable::Info& info, const T* data) {
+    VARP v = _Input(info.dim, NCHW, halide_type_of<T>());
+    memcpy(v->writeMap<T>(), data, info.size * sizeof(T));
+    if (info.type != halide_type_of<T>()) {
+        v = _Cast(v, info.type);
+    }
+    return info.order == NCHW ? v : _Convert(v, info.order);
+}
+
+// 读取 Module 输出 (任意排布) 为 CAFFE 排布
+static void readModuleOutput(VARP v, float* dst, int size) {
+    if (v->getInfo()->order != NCHW) {
+        v = _Convert(v, NCHW);
+    }
+    memcpy(dst, v->readMap<float>(), size * sizeof(float));
+}
+
+// 在 Flow 图末尾接上 Euler 更新：x_next = x_t + output * dt，图的输出从速度变为下一步 latent
+// 加载或图结构不符 (缺少 x_t / x_cond / t / s / output) 时返回空
+static std::vector<int8_t> buildEulerStepGraph(const std::string& flowPath) {
+    auto vars = Variable::loadMap(flowPath.c_str());
+    for (const char* name : {"x_t", "x_cond", "t", "s", "output"}) {
+        if (vars.find(name) == vars.end()) {
+            WriteLog("⚠️ Flow graph has no '%s', Express step unavailable", name);
+            return {};
+        }
+    }
+    auto dt = _Input({1}, NCHW);
+    dt->setName("dt");
+    auto xNext = _Add(vars["x_t"], _Multiply(vars["output"], dt));
+    xNext->setName("x_next");
+    return Variable::save({xNext});
+}
+
+// 按拓扑序复制一遍图中的算子节点，subst 中的节点 (输入) 替换为给定变量
+// 输入 / 常量节点不复制，多份拷贝共享同一组权重，保存时也只写一次
+static VARP replayGraph(const std::vector<EXPRP>& order, VARP output,
+                        const std::map<Expr*, VARP>& subst, const std::string& suffix) {
+    std::map<Expr*, EXPRP> cloned;
+    auto remap = [&](const VARP& v) -> VARP {
+        auto src = v->expr();
+        auto s = subst.find(src.first.get());
+        if (s != subst.end()) return s->second;
+        auto c = cloned.find(src.first.get());
+        return c != cloned.end() ? Variable::create(c->second, src.second) : v;
+    };
+    for (const auto& e : order) {
+        if (e->get() == nullptr) continue;
+        std::vector<VARP> inputs;
+        for (const auto& v : e->inputs()) {
+            inputs.push_back(remap(v));
+        }
+        auto copy = Expr::create(e->extra(), std::move(inputs), e->outputSize());
+        copy->setName(e->name() + suffix);
+        cloned[e.get()] = copy;
+    }
+    return remap(output);
+}
+
+// K 步展开的 Euler 图：K 次 Flow 求值与中间的 x += v * h 串成一张图，第 k 步 t = t0 + k * h
+// 输入 x_t / x_cond / s / t0 / h (t0 与 h 形状同 t)，输出 x_next；图结构不符或 t 不是 float 时返回空
+static std::vector<int8_t> buildUnrolledEulerGraph(const std::string& flowPath, int K) {
+    auto vars = Variable::loadMap(flowPath.c_str());
+    for (const char* name : {"x_t", "x_cond", "t", "s", "output"}) {
+        if (vars.find(name) == vars.end()) {
+            WriteLog("⚠️ Flow graph has no '%s', unrolled module unavailable", name);
+            return {};
+        }
+    }
+    auto tInfo = vars["t"]->getInfo();
+    if (!tInfo || tInfo->type != halide_type_of<float>()) {
+        WriteLog("⚠️ Flow input 't' is not float, unrolled module unavailable");
+        return {};
+    }
+    auto order = Variable::getExecuteOrder({vars["output"]});
+    auto t0 = _Input(tInfo->dim, tInfo->order);
+    t0->setName("t0");
+    auto h = _Input(tInfo->dim, tInfo->order);
+    h->setName("h");
+    VARP x = vars["x_t"];
+    for (int k = 0; k < K; k++) {
+        std::map<Expr*, VARP> subst;
+        subst[vars["x_t"]->expr().first.get()] = x;
+        subst[vars["t"]->expr().first.get()] = k == 0 ? t0 : _Add(t0, _Multiply(h, _Scalar<float>((float)k)));
+        VARP v = replayGraph(order, vars["output"], subst, "_u" + std::to_string(k));
+        x = _Add(x, _Multiply(v, h));
+    }
+    x->setName("x_next");
+    return Variable::save({x});
+}
+
+// 常量折叠：输入全是常量的单输出算子在 Express 中直接求值并替换为常量，返回折叠的算子数
+static int foldConstants(VARP output) {
+    int folded = 0;
+    for (const auto& e : Variable::getExecuteOrder({output})) {
+        if (e->get() == nullptr || e->outputSize() != 1 || e->inputs().empty()) continue;
+        bool allConst = true;
+        for (const auto& v : e->inputs()) {
+            auto src = v->expr().first;
+            allConst = allConst && src->get() == nullptr && src->inputType() == VARP::CONSTANT;
+        }
+        if (!allConst) continue;
+        VARP v = Variable::create(e);
+        auto info = v->getInfo();
+        const void* ptr = info ? v->readMap<void>() : nullptr;
+        if (!ptr) continue;
+        VARP c = _Const(ptr, info->dim, info->order, info->type);
+        Expr::replace(e, c->expr().first);
+        folded++;
+    }
+    return folded;
+}
+
+// 风格特化的 Flow 图：s 替换为常量后折叠风格嵌入子图，写入 outPath
+// 输入只剩 x_t / x_cond / t；图中没有 s 时返回 false
+static bool buildStyleFlowGraph(const std::string& flowPath, int style, const std::string& outPath) {
+    auto vars = Variable::loadMap(flowPath.c_str());
+    if (vars.find("s") == vars.end() || vars.find("output") == vars.end()) {
+        return false;
+    }
+    auto sInfo = vars["s"]->getInfo();
+    if (!sInfo) return false;
+    VARP sConst;
+    if (sInfo->type == halide_type_of<float>()) {
+        sConst = _Const((float)style, sInfo->dim, sInfo->order);
+    } else {
+        std::vector<int> values(std::max<size_t>(sInfo->size, 1), style);
+        sConst = _Const(values.data(), sInfo->dim, sInfo->order, halide_type_of<int>());
+    }
+    auto order = Variable::getExecuteOrder({vars["output"]});
+    VARP out = replayGraph(order, vars["output"], {{vars["s"]->expr().first.get(), sConst}}, "");
+    int folded = foldConstants(out);
+    out->setName("output");
+    Variable::save({out}, outPath.c_str());
+    WriteLog("Style %d Flow graph built: %d ops folded -> %s", style, folded, outPath.c_str());
+    return true;
+}
+
+// 删除旧模型遗留的派生图 (Flow_*.mnn，文件名不含当前指纹)
+static void pruneDerivedGraphs(const std::string& dir, const std::string& tag) {
+    DIR* d = opendir(dir.c_str());
+    if (!d) return;
+    while (dirent* ent = readdir(d)) {
+        std::string name = ent->d_name;
+        if (name.rfind("Flow_", 0) == 0 && name.find(tag) == std::string::npos &&
+            name.size() > 4 && name.compare(name.size() - 4, 4, ".mnn") == 0) {
+            remove((dir + "/" + name).c_str());
+        }
+    }
+    closedir(d);
+}
+
+// Flow 图切分中的一组循环外输入：只依赖这组输入 (及常量) 的算子提到单独的子网，
+// 以 prefix + k 命名的边界张量与每步子网衔接
+struct HoistGroup {
+    std::string prefix;
+    std::vector<std::string> inputs;
+    std::vector<int8_t> graph; // 输出：该组子网 (没有可提出的算子时为空)
+    int features = 0;
+};
+
+// 把 Flow 图切成若干循环外子网 + 每步的 loop 图：依赖标记只落在某一组上的算子归该组，
+// 其余 (依赖 x_t，或跨组) 留在 loop 图；loop 图保留仍被直接使用的原始输入
+// 所有组都切不出算子、边界形状未知或边界是多输出节点时返回 false
+static bool splitFlowGraph(const std::string& flowPath, std::vector<HoistGroup>& groups, std::vector<int8_t>& loopGraph) {
+    auto vars = Variable::loadMap(flowPath.c_str());
+    if (vars.find("output") == vars.end()) {
+        return false;
+    }
+    // 依赖标记：bit 0 = 未分组 (每步变化) 的输入，bit g+1 = 第 g 组输入
+    std::map<Expr*, int> mask;
+    for (const auto& kv : vars) {
+        auto e = kv.second->expr().first;
+        if (e->get() == nullptr && e->inputType() == VARP::INPUT) {
+            int bit = 1;
+            for (size_t g = 0; g < groups.size(); g++) {
+                const auto& in = groups[g].inputs;
+                if (std::find(in.begin(), in.end(), kv.first) != in.end()) bit = 2 << g;
+            }
+            mask[e.get()] = bit;
+        }
+    }
+    auto order = Variable::getExecuteOrder({vars["output"]});
+    std::vector<std::vector<VARP>> frontier(groups.size());
+    auto addFrontier = [&](const VARP& v, int consumer) -> bool {
+        auto e = v->expr().first;
+        int m = mask[e.get()];
+        if (e->get() == nullptr || m == consumer || m < 2 || (m & (m - 1)) != 0) return true;
+        if (e->outputSize() != 1 || !v->getInfo()) return false;
+        auto& f = frontier[__builtin_ctz(m) - 1];
+        for (const auto& x : f) {
+            if (x->expr().first == e) return true;
+        }
+        f.push_back(v);
+        return true;
+    };
+    for (const auto& e : order) {
+        if (e->get() == nullptr) continue;
+        int m = 0;
+        for (const auto& v : e->inputs()) {
+            m |= mask[v->expr().first.get()];
+        }
+        mask[e.get()] = m;
+        // 被其他组或每步节点引用的单组算子即切分边界
+        for (const auto& v : e->inputs()) {
+            if (!addFrontier(v, m)) return false;
+        }
+    }
+    if (!addFrontier(vars["output"], 1)) {
+        return false;
+    }
+    bool any = false;
+    for (const auto& f : frontier) {
+        any = any || !f.empty();
+    }
+    if (!any) return false;
+
+    std::map<Expr*, VARP> subst;
+    for (size_t g = 0; g < groups.size(); g++) {
+        for (size_t k = 0; k < frontier[g].size(); k++) {
+            auto info = frontier[g][k]->getInfo();
+            auto input = _Input(info->dim, info->order, info->type);
+            input->setName(groups[g].prefix + std::to_string(k));
+            subst[frontier[g][k]->expr().first.get()] = input;
+        }
+    }
+    VARP out = replayGraph(order, vars["output"], subst, "");
+    out->setName("output");
+    loopGraph = Variable::save({out});
+
+    for (size_t g = 0; g < groups.size(); g++) {
+        for (size_t k = 0; k < frontier[g].size(); k++) {
+            frontier[g][k]->setName(groups[g].prefix + std::to_string(k));
+        }
+        groups[g].features = (int)frontier[g].size();
+        groups[g].graph = frontier[g].empty() ? std::vector<int8_t>() : Variable::save(frontier[g]);
+    }
+    return true;
+}
+
+// 按名字写入 Session 输入 (data 为 CAFFE 排布)，Session 没有该输入时忽略
+// 数据类型与张量不同时逐元素转换 (float / int32)，其他类型不写入
+template <typename T>
+static void setSessionInput(Interpreter* net, Session* sess, const std::string& name, const T* data) {
+    const auto& all = net->getSessionInputAll(sess);
+    auto it = all.find(name);
+    if (it == all.end()) return;
+    std::unique_ptr<Tensor> h(new Tensor(it->second, Tensor::CAFFE));
+    const halide_type_t type = it->second->getType();
+    if (type == halide_type_of<T>()) {
+        memcpy(h->host<void>(), data, h->size());
+    } else if (type == halide_type_of<float>()) {
+        std::copy(data, data + h->elementSize(), h->host<float>());
+    } else if (type == halide_type_of<int32_t>()) {
+        std::copy(data, data + h->elementSize(), h->host<int32_t>());
+    } else {
+        WriteLog("⚠️ Input '%s' has unsupported type (code=%d bits=%d), left unset", name.c_str(), (int)type.code, (int)type.bits);
+        return;
+    }
+    it->second->copyFromHostTensor(h.get());
+}
+
+// Session 之间搬运张量 (经 CAFFE 排布的 Host 张量中转)
+static void copySessionTensor(Tensor* src, Tensor* dst) {
+    std::unique_ptr<Tensor> h(new Tensor(src, Tensor::CAFFE));
+    src->copyToHostTensor(h.get());
+    dst->copyFromHostTensor(h.get());
+}
+
+// Decoder 输出 (CHW, 0~1) 写入 512x512 RGBA 位图
+static void renderRGBA(const float* data, uint8_t* rgba) {
+    int total_pixels = 512 * 512;
+
+    // 简单的反归一化与排布
+    for (int i = 0; i < total_pixels; i++) {
+        // Channel 0, 1, 2 分别偏移 0, 262144, 524288
+        float r = data[i];
+        float g = data[i + total_pixels];
+        float b = data[i + total_pixels * 2];
+
+        rgba[i*4+0] = (uint8_t)std::clamp(r * 255.0f, 0.0f, 255.0f);
+        rgba[i*4+1] = (uint8_t)std::clamp(g * 255.0f, 0.0f, 255.0f);
+        rgba[i*4+2] = (uint8_t)std::clamp(b * 255.0f, 0.0f, 255.0f);
+        rgba[i*4+3] = 255; // Alpha
+    }
+}
+
+// 在 Decoder 输出后接上 renderRGBA 的同一套运算：x·255 截断到 [0, 255]，转 NHWC 后截断取整为 uint8，
+// 再拼上常量 alpha 通道；结果为 [1, H, W, 4] uint8，逐字节即位图内容。输出形状不是 [1, 3, H, W] 时返回空
+static VARP appendRender(VARP out) {
+    auto info = out->getInfo();
+    if (!info || info->dim.size() != 4 || info->dim[0] != 1 || info->dim[1] != 3) {
+        return nullptr;
+    }
+    if (info->order != NCHW) {
+        out = _Convert(out, NCHW);
+    }
+    auto rgb = _Relu6(_Multiply(out, _Scalar<float>(255.0f)), 0.0f, 255.0f);
+    rgb = _Cast<uint8_t>(_Transpose(rgb, {0, 2, 3, 1}));
+    std::vector<uint8_t> opaque(info->dim[2] * info->dim[3], 255);
+    auto alpha = _Const(opaque.data(), {1, info->dim[2], info->dim[3], 1}, NHWC, halide_type_of<uint8_t>());
+    auto rgba = _Concat({rgb, alpha}, 3);
+    rgba->setName("rgba");
+    return rgba;
+}
+
+// Decoder + 输出打包的合成图，主机端只剩一次 memcpy
+static std::vector<int8_t> buildDecoderRenderGraph(const std::string& decPath) {
+    auto vars = Variable::loadMap(decPath.c_str());
+    if (vars.find("input") == vars.end() || vars.find("output") == vars.end()) {
+        WriteLog("⚠️ Decoder graph has no 'input' / 'output', graph render unavailable");
+        return {};
+    }
+    auto rgba = appendRender(vars["output"]);
+    if (rgba.get() == nullptr) {
+        WriteLog("⚠️ Decoder output shape unknown or not [1, 3, H, W], graph render unavailable");
+        return {};
+    }
+    return Variable::save({rgba});
+}
+
+// 把 v 转成 like 的排布，跨模型拼接时衔接两侧的输入 / 输出约定
+static VARP matchOrder(VARP v, VARP like) {
+    auto want = like->getInfo();
+    auto have = v->getInfo();
+    return want && have && want->order != have->order ? _Convert(v, want->order) : v;
+}
+
+// 整条流水线合成一张图：Encoder → K 步 Euler (Flow 复制 K 份，t 固化为 k·h) → Decoder → RGBA 打包
+// 输入为 Encoder 的 "input" 与 Flow 的 "s"，输出 "rgba"；模型边界不再经过主机张量，
+// 三个模型的中间结果由同一个 RuntimeManager 统一规划内存。任一模型结构不符时返回空
+static std::vector<int8_t> buildPipelineGraph(const std::string& dir, int K, float h) {
+    auto enc = Variable::loadMap((dir + "/Encoder.mnn").c_str());
+    auto flow = Variable::loadMap((dir + "/Flow.mnn").c_str());
+    auto dec = Variable::loadMap((dir + "/Decoder.mnn").c_str());
+    if (enc.find("input") == enc.end() || enc.find("output") == enc.end() ||
+        dec.find("input") == dec.end() || dec.find("output") == dec.end()) {
+        WriteLog("⚠️ Encoder / Decoder graph has no 'input' / 'output', whole-graph pipeline unavailable");
+        return {};
+    }
+    for (const char* name : {"x_t", "x_cond", "t", "s", "output"}) {
+        if (flow.find(name) == flow.end()) {
+            WriteLog("⚠️ Flow graph has no '%s', whole-graph pipeline unavailable", name);
+            return {};
+        }
+    }
+    auto tInfo = flow["t"]->getInfo();
+    if (!tInfo || tInfo->type != halide_type_of<float>()) {
+        WriteLog("⚠️ Flow input 't' is not float, whole-graph pipeline unavailable");
+        return {};
+    }
+
+    // Encoder 输出同时作为 x_cond 与初始 x_t
+    VARP cond = matchOrder(enc["output"], flow["x_cond"]);
+    VARP x = matchOrder(enc["output"], flow["x_t"]);
+    auto order = Variable::getExecuteOrder({flow["output"]});
+    for (int k = 0; k < K; k++) {
+        std::map<Expr*, VARP> subst;
+        subst[flow["x_t"]->expr().first.get()] = x;
+        subst[flow["x_cond"]->expr().first.get()] = cond;
+        subst[flow["t"]->expr().first.get()] = _Const((float)k * h, tInfo->dim, tInfo->order);
+        VARP v = replayGraph(order, flow["output"], subst, "_u" + std::to_string(k));
+        x = _Add(x, _Multiply(v, _Const(h)));
+    }
+
+    std::map<Expr*, VARP> subst;
+    subst[dec["input"]->expr().first.get()] = matchOrder(x, dec["input"]);
+    VARP image = replayGraph(Variable::getExecuteOrder({dec["output"]}), dec["output"], subst, "_dec");
+    auto rgba = appendRender(image);
+    if (rgba.get() == nullptr) {
+        WriteLog("⚠️ Decoder output shape unknown or not [1, 3, H, W], whole-graph pipeline unavailable");
+        return {};
+    }
+    return Variable::save({rgba});
+}
+
+// RGBA 位图 -> Encoder 输入的预处理 (归一化到 [-1, 1])
+static CV::ImageProcess* createInputProcess() {
+    CV::ImageProcess::Config c;
+    c.sourceFormat = CV::RGBA; c.destFormat = CV::RGB;
+    // mean=[127.5, ...], normal=[1/127.5, ...]
+    float m[3]={127.5f, 127.5f, 127.5f};
+    float n[3]={0.007843f, 0.007843f, 0.007843f};
+    memcpy(c.mean, m, sizeof(m));
+    memcpy(c.normal, n, sizeof(n));
+    return CV::ImageProcess::create(c);
+}
+
+// 并发推理的会话池：Encoder / Flow / Decoder 各以 Module 加载一次，每个槽位是
+// Module::clone(shareParams) 得到的共享权重副本，带自己的 Executor (线程池) 与中间内存，按请求借出归还。
+// 不在同一个 Interpreter 上多建 Session：runSession 持有 Interpreter 级的锁，多个 Session 仍会串行
+// Module 直接从引擎 Interpreter 保留的模型 Buffer 加载，不再读文件；池存在期间引擎释放默认 Session，权重只驻留一份
+// 池化路径只做 Euler (固定网格或调度描述给出的网格)，取消 / 时间预算在步边界检查；其余选项见 unsupportedOption
+class SessionPool {
+public:
+    SessionPool(Interpreter* enc, Interpreter* flow, Interpreter* dec, const FlowSignature& sig,
+                const FlowSchedule& schedule, const BackendConfig& bConfig, int slots, int threads)
+        : mSig(sig), mSchedule(schedule), mThreads(threads) {
+        Module::Config mConfig;
+        mConfig.shapeMutable = false;
+        // Flow 输入按签名绑定，模型没有的输入不占位
+        std::vector<std::string> flowInputs;
+        for (const std::string* name : {&sig.xt, &sig.cond, &sig.t, &sig.s}) {
+            mFlowIndex.push_back(name->empty() ? -1 : (int)flowInputs.size());
+            if (!name->empty()) flowInputs.push_back(*name);
+        }
+        auto load = [&](Interpreter* net, const std::vector<std::string>& inputs, const std::string& output) {
+            auto buffer = net ? net->getModelBuffer() : std::make_pair((const void*)nullptr, (size_t)0);
+            Module* m = buffer.first ? Module::load(inputs, {output}, (const uint8_t*)buffer.first, buffer.second, &mConfig)
+                                     : nullptr;
+            return std::shared_ptr<Module>(m, Module::destroy);
+        };
+        mEnc = load(enc, {"input"}, "output");
+        mFlow = load(flow, flowInputs, sig.out);
+        mDec = load(dec, {"input"}, "output");
+        if (!mEnc || !mFlow || !mDec || sig.xt.empty()) {
+            WriteLog("⚠️ Session pool: modules failed to load, pool disabled");
+            return;
+        }
+        for (int i = 0; i < slots; i++) {
+            std::unique_ptr<Slot> slot(new Slot);
+            slot->id = i;
+            slot->executor = Executor::newExecutor(MNN_FORWARD_CPU, bConfig, threads);
+            ExecutorScope scope(slot->executor);
+            slot->enc.reset(Module::clone(mEnc.get(), true), Module::destroy);
+            slot->flow.reset(Module::clone(mFlow.get(), true), Module::destroy);
+            slot->dec.reset(Module::clone(mDec.get(), true), Module::destroy);
+            slot->imgProc.reset(createInputProcess());
+            if (!slot->enc || !slot->flow || !slot->dec) {
+                WriteLog("⚠️ Session pool: clone failed at slot %d", i);
+                break;
+            }
+            mFree.push_back(slot.get());
+            mSlots.push_back(std::move(slot));
+        }
+        WriteLog("Session pool ready: %d slots x %d threads, weights shared", (int)mSlots.size(), threads);
+    }
+
+    bool ready() const { return !mSlots.empty(); }
+
+    // 池化路径不实现的选项：改变结果的直接拒绝，只影响执行方式的 (图变体 / 缓存) 记日志后按普通 Euler 运行
+    static const char* unsupportedOption(const RunOptions& o) {
+        if (o.solver != FlowSolver::Euler) return "solver";
+        if (o.solverSteps > 0 && o.solverSteps != o.steps) return "solverSteps";
+        if (o.guidance > 0.0f) return "guidance";
+        if (o.fp32Steps > 0) return "fp32Steps";
+        if (o.coarseSteps > 0) return "coarseSteps";
+        if (o.earlyStop > 0.0f) return "earlyStop";
+        if (o.reuseDrift > 0.0f) return "reuseDrift";
+        return nullptr;
+    }
+
+    // input / output 为 512x512 RGBA；没有空闲槽位时阻塞等待。中止或失败时返回 false，output 不写入
+    bool run(const uint8_t* input, uint8_t* output, const RunOptions& opts, RunStats& stats) {
+        if (const char* option = unsupportedOption(opts)) {
+            WriteLog("❌ Session pool: option '%s' is not supported on the pooled path, request rejected", option);
+            return false;
+        }
+        if (opts.expressStep || opts.unroll > 1 || opts.styleGraph || opts.wholeGraph) {
+            WriteLog("⚠️ Session pool: expressStep / unroll / styleGraph / wholeGraph ignored, running the plain Euler graph");
+        }
+        auto t_all_start = std::chrono::high_resolution_clock::now();
+        RunGuard guard;
+        guard.cancel = opts.cancelFlag;
+        if (opts.deadlineMs > 0.0f) {
+            guard.hasDeadline = true;
+            guard.deadline = std::chrono::steady_clock::now() +
+                             std::chrono::microseconds((long long)(opts.deadlineMs * 1000.0f));
+        }
+        Slot* slot = checkout();
+        stats.queueMs = elapsedMs(t_all_start);
+        stats.poolSlot = slot->id;
+        bool ok = runSlot(*slot, input, output, opts, guard, stats);
+        stats.totalMs = elapsedMs(t_all_start);
+        checkin(slot, stats.queueMs, ok);
+        if (guard.reason != RunGuard::None) {
+            stats.deadlineExceeded = guard.reason == RunGuard::Deadline;
+            stats.cancelled = !stats.deadlineExceeded;
+            WriteLog("Aborted in pool: %s", stats.summary().c_str());
+        } else if (ok) {
+            WriteLog("Success: %s", stats.summary().c_str());
+        }
+        return ok;
+    }
+
+    std::string stats() {
+        std::lock_guard<std::mutex> lk(mMutex);
+        char buf[256];
+        snprintf(buf, sizeof(buf), "slots=%d threads=%d busy=%d peak_busy=%d runs=%ld failed=%ld wait avg=%.1fms max=%.1fms",
+                 (int)mSlots.size(), mThreads, (int)(mSlots.size() - mFree.size()), mPeakBusy, mRuns, mFailed,
+                 mRuns ? (float)(mWaitMsSum / mRuns) : 0.0f, mWaitMsMax);
+        return buf;
+    }
+
+private:
+    struct Slot {
+        int id = 0;
+        std::shared_ptr<Executor> executor; // 先于 Module 声明，最后释放
+        std::shared_ptr<Module> enc, flow, dec;
+        std::shared_ptr<CV::ImageProcess> imgProc;
+    };
+
+    Slot* checkout() {
+        std::unique_lock<std::mutex> lk(mMutex);
+        mCv.wait(lk, [&] { return !mFree.empty(); });
+        Slot* slot = mFree.back();
+        mFree.pop_back();
+        mPeakBusy = std::max(mPeakBusy, (int)(mSlots.size() - mFree.size()));
+        return slot;
+    }
+
+    void checkin(Slot* slot, float waitMs, bool ok) {
+        {
+            std::lock_guard<std::mutex> lk(mMutex);
+            mFree.push_back(slot);
+            mRuns++;
+            mFailed += ok ? 0 : 1;
+            mWaitMsSum += waitMs;
+            mWaitMsMax = std::max(mWaitMsMax, waitMs);
+        }
+        mCv.notify_one();
+    }
+
+    bool runSlot(Slot& slot, const uint8_t* input, uint8_t* output, const RunOptions& opts, RunGuard& guard, RunStats& stats) {
+        ExecutorScope scope(slot.executor);
+        const int size = mSig.size;
+        const auto& ts = mSchedule.timesteps;
+        const int steps = mSchedule.steps > 0 ? mSchedule.steps : std::max(1, std::min(opts.steps, 50));
+        stats.steps = steps;
+        stats.solverSteps = steps;
+        if (guard.check()) return false;
+
+        // --- STEP 1: ENCODER ---
+        auto t_start = std::chrono::high_resolution_clock::now();
+        std::unique_ptr<Tensor> hIn(Tensor::create<float>({1, 3, 512, 512}, nullptr, Tensor::CAFFE));
+        slot.imgProc->convert(input, 512, 512, 0, hIn.get());
+        auto encOut = slot.enc->onForward({makeModuleInput(slot.enc->getInfo()->inputs[0], hIn->host<float>())});
+        if (encOut.empty() || (int)encOut[0]->getInfo()->size != size) {
+            WriteLog("❌ Session pool: Encoder produced no / mismatched output");
+            return false;
+        }
+        std::vector<float> cond(size), v(size);
+        readModuleOutput(encOut[0], cond.data(), size);
+        std::vector<float> x = cond;
+        stats.encMs = elapsedMs(t_start);
+
+        // --- STEP 2: FLOW LOOP (Euler) ---
+        auto t_flow_start = std::chrono::high_resolution_clock::now();
+        const auto& in = slot.flow->getInfo()->inputs;
+        std::vector<VARP> args(in.size());
+        if (mFlowIndex[1] >= 0) args[mFlowIndex[1]] = makeModuleInput(in[mFlowIndex[1]], cond.data());
+        if (mFlowIndex[3] >= 0) args[mFlowIndex[3]] = makeModuleInput(in[mFlowIndex[3]], &opts.style);
+        for (int i = 0; i < steps; i++) {
+            if (guard.check()) return false;
+            float t = ts.empty() ? (float)i * mSchedule.dt : ts[i];
+            float h = ts.empty() ? mSchedule.dt : ts[i + 1] - ts[i];
+            args[mFlowIndex[0]] = makeModuleInput(in[mFlowIndex[0]], x.data());
+            if (mFlowIndex[2] >= 0) args[mFlowIndex[2]] = makeModuleInput(in[mFlowIndex[2]], &t);
+            auto outs = slot.flow->onForward(args);
+            if (outs.empty()) {
+                WriteLog("❌ Session pool: Flow produced no output at step %d", i);
+                return false;
+            }
+            readModuleOutput(outs[0], v.data(), size);
+            axpy(x.data(), x.data(), h, v.data(), size);
+            stats.executedSteps = i + 1;
+            stats.flowEvals++;
+            if (opts.onStep && !opts.onStep(i + 1, steps)) {
+                guard.reason = RunGuard::Cancelled;
+                return false;
+            }
+        }
+        stats.flowMs = elapsedMs(t_flow_start);
+        if (guard.check()) return false;
+
+        // --- STEP 3: DECODER ---
+        auto t_dec_start = std::chrono::high_resolution_clock::now();
+        auto decOut = slot.dec->onForward({makeModuleInput(slot.dec->getInfo()->inputs[0], x.data())});
+        if (decOut.empty() || decOut[0]->getInfo()->size != 3 * 512 * 512) {
+            WriteLog("❌ Session pool: Decoder produced no / mismatched output");
+            return false;
+        }
+        std::vector<float> rgb(3 * 512 * 512);
+        readModuleOutput(decOut[0], rgb.data(), (int)rgb.size());
+        renderRGBA(rgb.data(), output);
+        stats.decMs = elapsedMs(t_dec_start);
+        return true;
+    }
+
+    FlowSignature mSig;
+    FlowSchedule mSchedule;
+    int mThreads;
+    std::vector<int> mFlowIndex;                // x_t / x_cond / t / s 在 Flow 输入中的位置，-1 表示没有
+    std::shared_ptr<Module> mEnc, mFlow, mDec;  // 持有共享权重，先于各槽位声明，最后释放
+    std::vector<std::unique_ptr<Slot>> mSlots;
+    std::vector<Slot*> mFree;
+    std::mutex mMutex;
+    std::condition_variable mCv;
+    int mPeakBusy = 0;
+    long mRuns = 0, mFailed = 0;
+    double mWaitMsSum = 0;
+    float mWaitMsMax = 0;
+};
+
+// 阶段之间的有界队列：满时 push 阻塞 (背压)，close 之后 pop 取完剩余元素即返回 false
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : mCapacity(std::max<size_t>(1, capacity)) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lk(mMutex);
+        mNotFull.wait(lk, [&] { return mItems.size() < mCapacity; });
+        mItems.push_back(std::move(item));
+        mNotEmpty.notify_one();
+    }
+
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lk(mMutex);
+        mNotEmpty.wait(lk, [&] { return !mItems.empty() || mClosed; });
+        if (mItems.empty()) return false;
+        item = std::move(mItems.front());
+        mItems.pop_front();
+        mNotFull.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lk(mMutex);
+        mClosed = true;
+        mNotEmpty.notify_all();
+    }
+
+private:
+    size_t mCapacity;
+    std::deque<T> mItems;
+    bool mClosed = false;
+    std::mutex mMutex;
+    std::condition_variable mNotFull, mNotEmpty;
+};
+
+// 流水线的默认核组 (Encoder / Flow / Decoder)：CPU 按最高频率降序排列，Flow 循环 (最重) 占前一半，
+// Decoder 占剩余的一半，其余给 Encoder；少于 3 个核时各阶段共用全部核
+static void defaultStageCores(std::vector<int> cores[3]) {
+    const int n = std::max(1, (int)std::thread::hardware_concurrency());
+    std::vector<int> freq(n, 0), order(n);
+    for (int i = 0; i < n; i++) {
+        std::ifstream f("/sys/devices/system/cpu/cpu" + std::to_string(i) + "/cpufreq/cpuinfo_max_freq");
+        f >> freq[i];
+    }
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return freq[a] > freq[b]; });
+    if (n < 3) {
+        for (int k = 0; k < 3; k++) cores[k] = order;
+        return;
+    }
+    const int flowN = n / 2, decN = std::max(1, (n - flowN) / 2);
+    cores[1].assign(order.begin(), order.begin() + flowN);
+    cores[2].assign(order.begin() + flowN, order.begin() + flowN + decN);
+    cores[0].assign(order.begin() + flowN + decN, order.end());
+}
+
+static std::string coreList(const std::vector<int>& cores) {
+    std::string s;
+    for (int c : cores) s += (s.empty() ? "" : ",") + std::to_string(c);
+    return s;
+}
+
+class SAFlowEngine {
+public:
+    std::unique_ptr<Interpreter> netEnc, netFlow, netDec;
+    Session *sessEnc = nullptr, *sessFlow = nullptr, *sessDec = nullptr;
+    std::shared_ptr<CV::ImageProcess> imgProc;
+
+    std::string modelDir;
+    ScheduleConfig config;
+    BackendConfig bConfig;
+
+    // Express 路径：Flow 图末尾融合 Euler 更新后的 Module，首次使用时构建，失败则回退 Interpreter
+    std::shared_ptr<Executor::RuntimeManager> rtmgr;
+    std::shared_ptr<Module> eulerModule;
+    bool eulerModuleTried = false;
+
+    // K 步展开的 Module：K 次 Flow + 中间的 Euler 更新合成一次 dispatch
+    // 每个 Module 持有一份完整的 Flow 权重，只保留最近 2 个 K (一次切分最多用到 K 与尾块)
+    struct UnrolledModule {
+        int K;
+        std::shared_ptr<Module> module;
+    };
+    static constexpr int kMaxUnrolledModules = 2;
+    std::vector<UnrolledModule> unrolledModules; // 按最近使用排序，末尾最新
+    bool unrollUnavailable = false;              // 图结构不支持时不再重复尝试
+
+    // 由 Express 图构建的一个 Interpreter 子网
+    struct SubNet {
+        std::unique_ptr<Interpreter> net;
+        Session* sess = nullptr;
+        float flops = 0; // MFLOPs
+        int features = 0;
+
+        bool load(const std::vector<int8_t>& graph, const ScheduleConfig& cfg) {
+            if (graph.empty()) return false;
+            net.reset(Interpreter::createFromBuffer(graph.data(), graph.size()));
+            sess = net ? net->createSession(cfg) : nullptr;
+            if (!sess) return false;
+            net->releaseModel();
+            net->getSessionInfo(sess, Interpreter::FLOPS, &flops);
+            return true;
+        }
+    };
+
+    // Decoder + 输出打包的合成图，首次使用时构建
+    SubNet decRender;
+    bool decRenderTried = false;
+
+    // 整图流水线：Encoder → Flow×K → Decoder 合成的一个 Module，只保留最近一个步数；
+    // 使用独立的 RuntimeManager，内存统计只覆盖这一张图
+    struct PipelineModule {
+        int steps = 0;
+        std::shared_ptr<Executor::RuntimeManager> rtmgr;
+        std::shared_ptr<Module> module;
+    };
+    PipelineModule pipeline;
+    bool pipelineUnavailable = false;
+
+    // Flow 图切分：cond 子网 (x_cond / s 分支) 每图运行一次，输出 feat_k；
+    // time 子网 (时间嵌入) 在模型加载时按网格 t = i * flowSchedule.dt 预先算成表，输出 temb_k；loop 子网每步运行
+    static constexpr int kTimeTableSteps = 50; // Flow.schedule 未指定 steps 时覆盖 runPixels 的最大步数
+    struct FlowSplit {
+        SubNet cond, time, loop;
+        float timeGrid = 0.05f;                        // 表的网格间距，与 flowSchedule.dt 一致
+        std::vector<std::vector<float>> timeTable;     // [step] 依次拼接各 temb_k (CAFFE)
+        std::vector<Tensor*> tembIn;                   // loop 子网的 temb_k 输入
+        std::vector<std::unique_ptr<Tensor>> tembHost;
+        int tableHits = 0, tableMisses = 0;            // 当前这次推理的查表命中 / 未命中 (非网格 t)
+    };
+    std::unique_ptr<FlowSplit> flowSplit; // 完整 Flow.mnn 的切分，模型加载时构建
+    bool flowSplitTried = false;
+    float flowFlops = 0;                  // 完整 Flow 单次调用的 MFLOPs
+
+    // 风格特化的 Flow：s 固化为常量并折叠风格嵌入，按风格懒构建并持久化到缓存目录
+    struct StyleFlow {
+        int style = 0;
+        std::unique_ptr<Interpreter> net; // 构建 / 加载失败时为空，避免重复尝试
+        Session* sess = nullptr;
+        float flops = 0;
+        std::string path;
+        std::unique_ptr<FlowSplit> split; // 特化图上的切分，随特化图一起构建
+        bool splitTried = false;
+    };
+    static constexpr int kMaxStyleFlows = 2; // 每个特化图持有一份完整的 Flow 权重
+    std::vector<std::unique_ptr<StyleFlow>> styleFlows; // 按最近使用排序，末尾最新
+
+    // 批量推理的 Session (输入第 0 维 resize 为 batch)：每个 batch 大小一组，按需创建其中用到的部分；
+    // 最多保留 kMaxBatchSessions 组，按最近使用排序，末尾最新，淘汰时整组释放
+    struct BatchSessions {
+        int batch = 0;
+        Session* enc = nullptr;
+        Session* flow = nullptr;
+        Session* dec = nullptr;
+    };
+    static constexpr int kMaxBatchSessions = 2;
+    std::vector<BatchSessions> batchSessions;
+    BatchSessions defaultSessions; // batch 1：直接使用默认 Session
+
+    // 精度调度用的第二个 Flow Session：同一个 Interpreter (共用已加载的模型)，Precision_Normal
+    ScheduleConfig preciseConfig;
+    BackendConfig preciseBConfig;
+    Session* sessFlowPrecise = nullptr;
+    bool sessFlowPreciseTried = false;
+
+    // 粗分辨率 Flow Session：x_t / x_cond 的空间尺寸减半；coarseShape 为全分辨率 x_t 的 [c, h, w]
+    Session* sessFlowCoarse = nullptr;
+    bool sessFlowCoarseTried = false;
+    int coarseShape[3] = {0, 0, 0};
+
+    // 并发请求的会话池，首次使用时构建；重新配置时换成新池，进行中的请求持有旧池直到结束
+    std::shared_ptr<SessionPool> sessionPool;
+    bool sessionPoolTried = false;
+    bool defaultSessionsReleased = false; // 会话池在用，默认 Session 已释放
+    int poolSlots = 2;
+    int poolThreads = 0; // 每个槽位的线程数，0 表示按 config.numThread 平分
+
+    // 分阶段流水线：Encoder / Flow / Decoder 各有一个独立的 Session，线程数等于核组大小，
+    // 创建时经 CPU_CORE_IDS 绑到各自的核组；三个 Session 分别建在主 Encoder / Flow / Decoder Interpreter 上
+    // (模型 Buffer 保留，不重新加载文件)，不同的 Interpreter 可以同时运行
+    struct StageSessions {
+        Interpreter* net[3] = {nullptr, nullptr, nullptr};
+        Session* sess[3] = {nullptr, nullptr, nullptr}; // Encoder / Flow / Decoder
+        std::vector<int> cores[3];
+    };
+    StageSessions stages;
+    bool stagesTried = false;
+    std::vector<int> stageCoreConfig[3]; // 为空的阶段按 defaultStageCores 分配
+    std::string lastPipelineReport;
+
+    SAFlowEngine(const std::string& path) : modelDir(path) {
+        // 每次初始化清空旧日志
+        SetLogPath(path + "/sa_debug.txt");
+
+        WriteLog("=== ENGINE INIT: CPU SAFE MODE ===");
+        WriteLog("Model Path: %s", path.c_str());
+
+        // --- CPU 优化配置 ---
+        config.type = MNN_FORWARD_CPU; // 强制 CPU
+        config.numThread = 4;          // 4线程平衡性能与发热
+
+        bConfig.precision = BackendConfig::Precision_Low; // 开启 FP16 (ARMv8.2+)
+        bConfig.power = BackendConfig::Power_High;        // 倾向使用大核
+        bConfig.memory = BackendConfig::Memory_High;      // 空间换时间
+        config.backendConfig = &bConfig;
+
+        // 加载 Encoder
+        netEnc.reset(Interpreter::createFromFile((path + "/Encoder.mnn").c_str()));
+        if (netEnc) {
+            sessEnc = netEnc->createSession(config);
+            // 保留模型 Buffer：批量推理按 batch 大小另建 Session
+        } else {
+            WriteLog("❌ Failed to load Encoder.mnn");
+        }
+
+        // 加载 Flow (注意：这里会读取最新的 Flow.mnn)
+        flowFingerprint = fileFingerprint(path + "/Flow.mnn");
+        pruneDerivedGraphs(path, fingerprintTag());
+        netFlow.reset(Interpreter::createFromFile((path + "/Flow.mnn").c_str()));
+        if (netFlow) {
+            sessFlow = netFlow->createSession(config);
+            netFlow->getSessionInfo(sessFlow, Interpreter::FLOPS, &flowFlops);
+            flowSig = inspectFlowSignature(netFlow.get(), sessFlow);
+            flowSchedule = loadFlowSchedule(path + "/Flow.schedule");
+            // 切分与时间嵌入表随模型加载一次算好，Flow.mnn 替换后引擎重建时重新生成
+            if (flowSig.canonical()) {
+                getFlowSplit(path + "/Flow.mnn", flowFlops, flowSplit, flowSplitTried);
+            }
+        } else {
+            WriteLog("❌ Failed to load Flow.mnn");
+        }
+
+        // 加载 Decoder
+        netDec.reset(Interpreter::createFromFile((path + "/Decoder.mnn").c_str()));
+        if (netDec) {
+            sessDec = netDec->createSession(config);
+            // 保留模型 Buffer：批量解码按 batch 大小另建 Session
+        } else {
+            WriteLog("❌ Failed to load Decoder.mnn");
+        }
+
+        WriteLog(">>> CPU Engine Ready (FP16, 4 Threads) <<<");
+    }
+
+    RunStats lastStats;
+
+    // Flow 模型的输入绑定与可选的调度描述，模型加载时确定
+    FlowSignature flowSig;
+    FlowSchedule flowSchedule;
+
+    // 非标准签名或非均匀网格：只走完整 Flow 图的 Interpreter 路径，各派生图 / 调度一律不用
+    bool customFlow() const {
+        return !flowSig.canonical() || !flowSchedule.timesteps.empty();
+    }
+
+    // Encoder 输出与 Decoder 输入都按 flowSig.size 个元素读写 latent，三者必须一致，且 Flow 必须有 x_t
+    bool latentShapesMatch() const {
+        const int encSize = netEnc->getSessionOutput(sessEnc, "output")->elementSize();
+        const int decSize = netDec->getSessionInput(sessDec, "input")->elementSize();
+        if (flowSig.xt.empty() || encSize != flowSig.size || decSize != flowSig.size) {
+            WriteLog("❌ Flow signature mismatch: x_t='%s' latent=%d, encoder output=%d, decoder input=%d",
+                     flowSig.xt.c_str(), flowSig.size, encSize, decSize);
+            return false;
+        }
+        return true;
+    }
+
+    // 切分 path 指向的 Flow 图并加载各子网；每步计算量没有下降则放弃
+    FlowSplit* getFlowSplit(const std::string& path, float fullFlops, std::unique_ptr<FlowSplit>& slot, bool& tried) {
+        if (!tried) {
+            tried = true;
+            std::vector<HoistGroup> groups(2);
+            groups[0].prefix = "feat_";
+            groups[0].inputs = {"x_cond", "s"};
+            groups[1].prefix = "temb_";
+            groups[1].inputs = {"t"};
+            std::vector<int8_t> loop;
+            if (splitFlowGraph(path, groups, loop)) {
+                slot.reset(new FlowSplit);
+                slot->cond.features = groups[0].features;
+                slot->time.features = groups[1].features;
+                bool ok = slot->loop.load(loop, config) && slot->loop.flops < fullFlops &&
+                          (groups[0].graph.empty() || slot->cond.load(groups[0].graph, config)) &&
+                          (groups[1].graph.empty() || slot->time.load(groups[1].graph, config));
+                if (!ok) slot.reset();
+            }
+            if (slot) {
+                buildTimeTable(*slot);
+                WriteLog("Flow split ready: per-step %.1f -> %.1f MFLOPs, cond %d features (%.1f MFLOPs/image), "
+                         "time %d features x %d steps",
+                         fullFlops, slot->loop.flops, slot->cond.features, slot->cond.flops,
+                         slot->time.features, (int)slot->timeTable.size());
+            } else {
+                WriteLog("⚠️ Flow graph has no separable condition / time branch, split disabled");
+            }
+        }
+        return slot.get();
+    }
+
+    // 时间嵌入表：t 只取网格值 i * flowSchedule.dt (runPixels 的均匀步长)，逐个跑一遍 time 子网并保存 temb_k
+    void buildTimeTable(FlowSplit& sp) {
+        sp.timeGrid = flowSchedule.dt;
+        const int tableSteps = flowSchedule.steps > 0 ? flowSchedule.steps : kTimeTableSteps;
+        for (int k = 0; k < sp.time.features; k++) {
+            std::string name = "temb_" + std::to_string(k);
+            Tensor* in = sp.loop.net->getSessionInput(sp.loop.sess, name.c_str());
+            sp.tembIn.push_back(in);
+            sp.tembHost.emplace_back(new Tensor(in, Tensor::CAFFE));
+        }
+        if (!sp.time.net) return;
+        for (int i = 0; i <= tableSteps; i++) {
+            float t = (float)i * sp.timeGrid;
+            setSessionInput(sp.time.net.get(), sp.time.sess, "t", &t);
+            sp.time.net->runSession(sp.time.sess);
+            std::vector<float> row;
+            for (int k = 0; k < sp.time.features; k++) {
+                std::string name = "temb_" + std::to_string(k);
+                Tensor* out = sp.time.net->getSessionOutput(sp.time.sess, name.c_str());
+                out->copyToHostTensor(sp.tembHost[k].get());
+                const float* v = sp.tembHost[k]->host<float>();
+                row.insert(row.end(), v, v + sp.tembHost[k]->elementSize());
+            }
+            sp.timeTable.push_back(std::move(row));
+        }
+    }
+
+    // 每步写入时间嵌入：网格上的 t 直接查表，其余 t (中点 / 自适应步长) 现算
+    void feedTime(FlowSplit& sp, float t, bool useTable) {
+        if (!sp.time.net) return;
+        float fi = t / sp.timeGrid;
+        int i = (int)std::lround(fi);
+        if (useTable && i >= 0 && i < (int)sp.timeTable.size() && std::fabs(fi - (float)i) < 1e-4f) {
+            const float* src = sp.timeTable[i].data();
+            for (int k = 0; k < sp.time.features; k++) {
+                memcpy(sp.tembHost[k]->host<float>(), src, sp.tembHost[k]->size());
+                sp.tembIn[k]->copyFromHostTensor(sp.tembHost[k].get());
+                src += sp.tembHost[k]->elementSize();
+            }
+            sp.tableHits++;
+            return;
+        }
+        setSessionInput(sp.time.net.get(), sp.time.sess, "t", &t);
+        runChecked(sp.time.net.get(), sp.time.sess);
+        for (int k = 0; k < sp.time.features; k++) {
+            std::string name = "temb_" + std::to_string(k);
+            copySessionTensor(sp.time.net->getSessionOutput(sp.time.sess, name.c_str()), sp.tembIn[k]);
+        }
+        sp.tableMisses++;
+    }
+
+    // 派生图文件名中的模型指纹，Flow.mnn 替换后旧文件自动失效
+    std::string fingerprintTag() const {
+        char tag[20];
+        snprintf(tag, sizeof(tag), "%016llx", (unsigned long long)flowFingerprint);
+        return tag;
+    }
+
+    // 风格特化的 Flow：缓存目录已有对应指纹的文件则直接加载，否则从 Flow.mnn 构建并写入
+    StyleFlow* getStyleFlow(int style) {
+        for (size_t i = 0; i < styleFlows.size(); i++) {
+            if (styleFlows[i]->style == style) {
+                std::rotate(styleFlows.begin() + i, styleFlows.begin() + i + 1, styleFlows.end());
+                return styleFlows.back()->net ? styleFlows.back().get() : nullptr;
+            }
+        }
+        std::unique_ptr<StyleFlow> sf(new StyleFlow);
+        sf->style = style;
+        sf->path = modelDir + "/Flow_s" + std::to_string(style) + "_" + fingerprintTag() + ".mnn";
+        struct stat st;
+        bool ready = stat(sf->path.c_str(), &st) == 0 || buildStyleFlowGraph(modelDir + "/Flow.mnn", style, sf->path);
+        if (ready) {
+            sf->net.reset(Interpreter::createFromFile(sf->path.c_str()));
+        }
+        if (sf->net) {
+            sf->sess = sf->net->createSession(config);
+            sf->net->releaseModel();
+            sf->net->getSessionInfo(sf->sess, Interpreter::FLOPS, &sf->flops);
+            WriteLog("Style %d Flow ready: %.1f -> %.1f MFLOPs per step", style, flowFlops, sf->flops);
+            getFlowSplit(sf->path, sf->flops, sf->split, sf->splitTried);
+        } else {
+            WriteLog("⚠️ Style %d Flow graph unavailable, using shared Flow", style);
+            remove(sf->path.c_str());
+        }
+        if ((int)styleFlows.size() >= kMaxStyleFlows) {
+            styleFlows.erase(styleFlows.begin());
+        }
+        styleFlows.push_back(std::move(sf));
+        return styleFlows.back()->net ? styleFlows.back().get() : nullptr;
+    }
+
+    // 每图一次：运行 condition 子网，把边界特征写入每步子网；每步子网仍直接使用的 x_cond / s 一并写入
+    void runCondSplit(FlowSplit& sp, const float* cond, int style) {
+        setSessionInput(sp.loop.net.get(), sp.loop.sess, "x_cond", cond);
+        setSessionInput(sp.loop.net.get(), sp.loop.sess, "s", &style);
+        sp.tableHits = sp.tableMisses = 0;
+        if (!sp.cond.net) return;
+        setSessionInput(sp.cond.net.get(), sp.cond.sess, "x_cond", cond);
+        setSessionInput(sp.cond.net.get(), sp.cond.sess, "s", &style);
+        runCondFeatures(sp);
+    }
+
+    // 用 cond 子网已写入的 x_cond / s 重算 feat_k；condCache 关闭时每次 Flow 调用前都重算
+    void runCondFeatures(FlowSplit& sp) {
+        if (!sp.cond.net) return;
+        runChecked(sp.cond.net.get(), sp.cond.sess);
+        for (int k = 0; k < sp.cond.features; k++) {
+            std::string name = "feat_" + std::to_string(k);
+            copySessionTensor(sp.cond.net->getSessionOutput(sp.cond.sess, name.c_str()),
+                              sp.loop.net->getSessionInput(sp.loop.sess, name.c_str()));
+        }
+    }
+
+    SubNet* getDecoderRender() {
+        if (!decRenderTried) {
+            decRenderTried = true;
+            if (!decRender.load(buildDecoderRenderGraph(modelDir + "/Decoder.mnn"), config)) {
+                WriteLog("⚠️ Decoder render graph unavailable, using host render");
+            } else {
+                WriteLog("Decoder render graph ready (%.1f MFLOPs)", decRender.flops);
+            }
+        }
+        return decRender.sess ? &decRender : nullptr;
+    }
+
+    Module* getPipelineModule(int steps) {
+        if (pipeline.module && pipeline.steps == steps) return pipeline.module.get();
+        if (pipelineUnavailable) return nullptr;
+        auto t_build = std::chrono::high_resolution_clock::now();
+        pipeline.module.reset(); // 先释放旧步数的图，避免两份权重同时驻留
+        auto graph = buildPipelineGraph(modelDir, steps, flowSchedule.dt);
+        if (graph.empty()) {
+            pipelineUnavailable = true;
+            return nullptr;
+        }
+        if (!pipeline.rtmgr) {
+            pipeline.rtmgr.reset(Executor::RuntimeManager::createRuntimeManager(config), Executor::RuntimeManager::destroy);
+        }
+        Module::Config mConfig;
+        mConfig.shapeMutable = false;
+        pipeline.module.reset(Module::load({"input", "s"}, {"rgba"}, (const uint8_t*)graph.data(), graph.size(),
+                                           pipeline.rtmgr, &mConfig), Module::destroy);
+        if (!pipeline.module) {
+            WriteLog("⚠️ Whole-graph pipeline module failed to load");
+            pipelineUnavailable = true;
+            return nullptr;
+        }
+        pipeline.steps = steps;
+        WriteLog("Whole-graph pipeline module (steps=%d) built in %.1fms", steps, elapsedMs(t_build));
+        return pipeline.module.get();
+    }
+
+    // 整图路径：一次 onForward 完成 Encoder / Flow 循环 / Decoder / 打包，不可用时返回 false
+    bool runPipeline(const uint8_t* pixels, uint8_t* rgba, int style, int steps, RunStats& stats) {
+        Module* m = getPipelineModule(steps);
+        if (!m) return false;
+        const auto& in = m->getInfo()->inputs;
+        std::unique_ptr<Tensor> hIn(Tensor::create<float>({1, 3, 512, 512}, nullptr, Tensor::CAFFE));
+        convertInput(pixels, hIn.get());
+        auto outs = m->onForward({makeModuleInput(in[0], hIn->host<float>()), makeModuleInput(in[1], &style)});
+        auto info = outs.empty() ? nullptr : outs[0]->getInfo();
+        if (!info || info->size != 512 * 512 * 4) {
+            WriteLog("⚠️ Whole-graph pipeline produced no / mismatched output");
+            return false;
+        }
+        memcpy(rgba, outs[0]->readMap<uint8_t>(), info->size);
+        stats.wholeGraph = true;
+        stats.executedSteps = steps;
+        stats.flowEvals = steps;
+        stats.dispatches = 1;
+        return true;
+    }
+
+    // 会话池建在各 Interpreter 的模型 Buffer 上；建成后释放默认的 Encoder / Flow / Decoder Session，
+    // 池与引擎路径互斥，引擎路径下次使用时经 ensureDefaultSessions 丢弃池并重建默认 Session
+    std::shared_ptr<SessionPool> getSessionPool() {
+        if (!sessionPoolTried && netFlow) {
+            sessionPoolTried = true;
+            int threads = poolThreads > 0 ? poolThreads : std::max(1, config.numThread / poolSlots);
+            auto pool = std::make_shared<SessionPool>(netEnc.get(), netFlow.get(), netDec.get(), flowSig, flowSchedule,
+                                                      bConfig, poolSlots, threads);
+            if (pool->ready()) {
+                sessionPool = pool;
+                releaseDefaultSessions();
+            }
+        }
+        return sessionPool;
+    }
+
+    void releaseDefaultSessions() {
+        if (sessEnc) netEnc->releaseSession(sessEnc);
+        if (sessFlow) netFlow->releaseSession(sessFlow);
+        if (sessDec) netDec->releaseSession(sessDec);
+        sessEnc = sessFlow = sessDec = nullptr;
+        defaultSessionsReleased = true;
+        WriteLog("Default sessions released while the session pool is active");
+    }
+
+    // 引擎路径的入口调用：会话池在用时先丢弃池 (进行中的池化请求持有旧池直到结束)，再重建默认 Session
+    void ensureDefaultSessions() {
+        if (!defaultSessionsReleased) return;
+        defaultSessionsReleased = false;
+        sessionPool.reset();
+        sessionPoolTried = false;
+        if (netEnc && !sessEnc) sessEnc = netEnc->createSession(config);
+        if (netFlow && !sessFlow) sessFlow = netFlow->createSession(config);
+        if (netDec && !sessDec) sessDec = netDec->createSession(config);
+        WriteLog("Session pool released, default sessions restored");
+    }
+
+    void configureSessionPool(int slots, int threads) {
+        poolSlots = std::max(1, std::min(slots, 8));
+        poolThreads = std::max(0, threads);
+        ensureDefaultSessions();
+        sessionPool.reset();
+        sessionPoolTried = false;
+    }
+
+    StageSessions* getStageSessions() {
+        if (!stagesTried && netEnc && netFlow && netDec) {
+            stagesTried = true;
+            stages.net[0] = netEnc.get();
+            stages.net[1] = netFlow.get();
+            stages.net[2] = netDec.get();
+            Interpreter** nets = stages.net;
+            defaultStageCores(stages.cores);
+            for (int k = 0; k < 3; k++) {
+                if (!stageCoreConfig[k].empty()) stages.cores[k] = stageCoreConfig[k];
+                ScheduleConfig c = config;
+                c.numThread = std::max(1, (int)stages.cores[k].size());
+                nets[k]->setSessionHint(Interpreter::CPU_CORE_IDS, stages.cores[k].data(), stages.cores[k].size());
+                stages.sess[k] = nets[k]->createSession(c);
+                // 清除绑核提示 (空列表即不绑核)，之后在主 Interpreter 上创建的 Session 不受影响
+                nets[k]->setSessionHint(Interpreter::CPU_CORE_IDS, nullptr, 0);
+            }
+            if (!stages.sess[0] || !stages.sess[1] || !stages.sess[2]) {
+                WriteLog("⚠️ Stage pipeline sessions unavailable");
+                releaseStageSessions();
+                stagesTried = true;
+            } else {
+                WriteLog("Stage pipeline sessions: enc=[%s] flow=[%s] dec=[%s]", coreList(stages.cores[0]).c_str(),
+                         coreList(stages.cores[1]).c_str(), coreList(stages.cores[2]).c_str());
+            }
+        }
+        return stages.sess[0] ? &stages : nullptr;
+    }
+
+    void releaseStageSessions() {
+        for (int k = 0; k < 3; k++) {
+            if (stages.sess[k]) stages.net[k]->releaseSession(stages.sess[k]);
+            stages.sess[k] = nullptr;
+            stages.net[k] = nullptr;
+        }
+        stagesTried = false;
+    }
+
+    // 各阶段的核组，空表示自动分配；下次使用时按新核组重建 Session
+    void configureStagePipeline(const std::vector<int> cores[3]) {
+        for (int k = 0; k < 3; k++) stageCoreConfig[k] = cores[k];
+        releaseStageSessions();
+    }
+
+    // 会话占用的内存 (MB)，Session 为空时为 0
+    static float sessionMemoryMB(Interpreter* net, Session* sess) {
+        float mb = 0;
+        if (net && sess) net->getSessionInfo(sess, Interpreter::MEMORY, &mb);
+        return mb;
+    }
+
+    // 加载 Express 图为 Module；makeModuleInput 只处理 NCHW / NC4HW4 排布的 4 维输入，遇到 NHWC 放弃
+    std::shared_ptr<Module> loadExpressModule(const std::vector<int8_t>& graph, const std::vector<std::string>& inputs,
+                                              const std::vector<std::string>& outputs) {
+        if (graph.empty()) return nullptr;
+        if (!rtmgr) {
+            rtmgr.reset(Executor::RuntimeManager::createRuntimeManager(config), Executor::RuntimeManager::destroy);
+        }
+        Module::Config mConfig;
+        mConfig.shapeMutable = false;
+        std::shared_ptr<Module> m(Module::load(inputs, outputs, (const uint8_t*)graph.data(), graph.size(), rtmgr, &mConfig),
+                                  Module::destroy);
+        for (const auto& info : m ? m->getInfo()->inputs : std::vector<Variable::Info>()) {
+            if (info.order == NHWC && info.dim.size() == 4) {
+                return nullptr;
+            }
+        }
+        return m;
+    }
+
+    Module* getEulerModule() {
+        if (!eulerModuleTried) {
+            eulerModuleTried = true;
+            eulerModule = loadExpressModule(buildEulerStepGraph(modelDir + "/Flow.mnn"),
+                                            {"x_t", "x_cond", "t", "s", "dt"}, {"x_next"});
+            WriteLog(eulerModule ? "Express Euler step module ready" : "⚠️ Express Euler step unavailable, using Interpreter");
+        }
+        return eulerModule.get();
+    }
+
+    // K 步展开的 Module，按 K 缓存；起始 t 与步长作为输入，续算 / 换步长不需要新 Module
+    // 图结构不支持时不再尝试；加载失败 (如内存不足) 只影响本次，下次仍会重试
+    Module* getUnrolledModule(int K) {
+        for (auto it = unrolledModules.begin(); it != unrolledModules.end(); ++it) {
+            if (it->K == K) {
+                std::rotate(it, it + 1, unrolledModules.end());
+                return unrolledModules.back().module.get();
+            }
+        }
+        auto t_build = std::chrono::high_resolution_clock::now();
+        auto graph = buildUnrolledEulerGraph(modelDir + "/Flow.mnn", K);
+        if (graph.empty()) {
+            unrollUnavailable = true;
+            return nullptr;
+        }
+        auto m = loadExpressModule(graph, {"x_t", "x_cond", "s", "t0", "h"}, {"x_next"});
+        if (!m) {
+            // 与构建失败一样不再重试；加载成功之前不淘汰已有的模块
+            WriteLog("⚠️ Unrolled Flow module (K=%d) failed to load, unroll disabled", K);
+            unrollUnavailable = true;
+            return nullptr;
+        }
+        if ((int)unrolledModules.size() >= kMaxUnrolledModules) {
+            unrolledModules.erase(unrolledModules.begin());
+        }
+        WriteLog("Unrolled Flow module ready: K=%d (%.1fms)", K, elapsedMs(t_build));
+        unrolledModules.push_back({K, m});
+        return m.get();
+    }
+
+    // 展开路径：以 K 步为一块切分 n 步，尾块用更短的展开；任一块不可用则返回空，调用方回退逐步路径
+    std::vector<Module*> planUnrolled(int K, int n) {
+        std::vector<Module*> plan;
+        for (int i = 0; i < n && !unrollUnavailable; i += K) {
+            Module* m = getUnrolledModule(std::min(K, n - i));
+            if (!m) return {};
+            plan.push_back(m);
+        }
+        return plan;
+    }
+
+    // 依次执行展开的 Module，x 输入输出均为 CAFFE 排布；latent 在块之间以 Module 输出的 VARP 传递
+    // plan 按 planUnrolled(K, n) 的切法覆盖从 t0 起的 n 步，onStep 在每次 dispatch 后调用；
+    // 返回完成的步数，某块没有输出时停在该块之前
+    int runUnrolled(const std::vector<Module*>& plan, float* x, const float* cond, int style, float t0, float h,
+                    int K, int n, const std::function<bool(int)>& onStep = nullptr) {
+        const auto& in = plan[0]->getInfo()->inputs;
+        const int size = in[0].size;
+        VARP xt = makeModuleInput(in[0], x);
+        VARP xc = makeModuleInput(in[1], cond);
+        VARP s = makeModuleInput(in[2], &style);
+        VARP hv = makeModuleInput(in[4], &h);
+        int done = 0;
+        for (Module* m : plan) {
+            const float tb = t0 + (float)done * h;
+            auto outs = m->onForward({xt, xc, s, makeModuleInput(in[3], &tb), hv});
+            if (outs.empty()) {
+                WriteLog("⚠️ Unrolled Flow module produced no output after %d steps", done);
+                break;
+            }
+            xt = outs[0];
+            if (xt->getInfo()->order != in[0].order) {
+                xt = _Convert(xt, in[0].order);
+            }
+            done = std::min(done + K, n);
+            if (onStep && !onStep(done)) break;
+        }
+        readModuleOutput(xt, x, size);
+        return done;
+    }
+
+    // Express 路径的 Euler 循环：每步一次 onForward 直接得到下一步 latent，Host 不参与逐元素计算
+    // x 输入输出均为 CAFFE 排布，返回实际执行的步数
+    int runExpressEuler(Module* m, float* x, const float* cond, int style, float t0, float h, int n,
+                        float earlyStop, bool maxNorm, const std::function<bool(int)>& onStep = nullptr) {
+        const auto& in = m->getInfo()->inputs;
+        const int size = in[0].size;
+        VARP xt = makeModuleInput(in[0], x);
+        VARP xc = makeModuleInput(in[1], cond);
+        VARP s = makeModuleInput(in[3], &style);
+        VARP dt = makeModuleInput(in[4], &h);
+        std::vector<float> prev;
+        int i = 0;
+        while (i < n) {
+            float t = t0 + (float)i * h;
+            auto outs = m->onForward({xt, xc, makeModuleInput(in[2], &t), s, dt});
+            if (outs.empty()) {
+                WriteLog("⚠️ Express Euler module produced no output at step %d", i);
+                break;
+            }
+            VARP next = outs[0];
+            if (next->getInfo()->order != in[0].order) {
+                next = _Convert(next, in[0].order);
+            }
+            i++;
+            if (earlyStop > 0.0f) {
+                prev.assign(x, x + size);
+                readModuleOutput(next, x, size);
+                if (relativeUpdate(prev.data(), x, size, maxNorm) < earlyStop) {
+                    return i;
+                }
+            }
+            xt = next;
+            if (onStep && !onStep(i)) {
+                break;
+            }
+        }
+        readModuleOutput(xt, x, size);
+        return i;
+    }
+
+    // 轨迹缓存：每个 (输入图, 风格, 模型) 保留最近的 latent 与步数，加步数时从这里继续
+    struct Trajectory {
+        uint64_t key = 0;
+        int step = 0;
+        std::vector<float> latent;
+        std::vector<float> cond;   // Encoder 输出 (x_cond)，命中时可跳过 Encoder
+    };
+    static constexpr int kMaxTrajectories = 4;
+    std::vector<Trajectory> trajectories; // 按最近使用排序，末尾最新
+    uint64_t flowFingerprint = 0;
+
+    uint64_t trajectoryKey(const uint8_t* pixels, size_t bytes, int style, FlowSolver solver) const {
+        uint64_t hsh = fnv1a(pixels, bytes, flowFingerprint);
+        return fnv1a((const uint8_t*)&style, sizeof(style), hsh) ^ ((uint64_t)solver << 56);
+    }
+
+    // 只有缓存步数在 [minStep, steps] 内时才能继续；否则从头计算并覆盖
+    Trajectory* findTrajectory(uint64_t key, int steps, int minStep = 0) {
+        for (size_t i = 0; i < trajectories.size(); i++) {
+            if (trajectories[i].key == key && trajectories[i].step <= steps && trajectories[i].step >= minStep) {
+                std::rotate(trajectories.begin() + i, trajectories.begin() + i + 1, trajectories.end());
+                return &trajectories.back();
+            }
+        }
+        return nullptr;
+    }
+
+    void saveTrajectory(uint64_t key, int step, const float* latent, const float* cond, int size) {
+        auto it = std::find_if(trajectories.begin(), trajectories.end(), [&](const Trajectory& tr) { return tr.key == key; });
+        if (it != trajectories.end()) {
+            trajectories.erase(it);
+        } else if ((int)trajectories.size() >= kMaxTrajectories) {
+            trajectories.erase(trajectories.begin());
+        }
+        Trajectory tr;
+        tr.key = key;
+        tr.step = step;
+        tr.latent.assign(latent, latent + size);
+        tr.cond.assign(cond, cond + size);
+        trajectories.push_back(std::move(tr));
+    }
+
+    // RGBA 位图 -> Encoder 输入 (归一化到 [-1, 1])
+    void convertInput(const uint8_t* pixels, Tensor* dest) {
+        if (!imgProc) {
+            imgProc.reset(createInputProcess());
+        }
+        imgProc->convert(pixels, 512, 512, 0, dest);
+    }
+
+    Session* getPreciseFlowSession() {
+        if (!sessFlowPreciseTried && netFlow) {
+            sessFlowPreciseTried = true;
+            preciseConfig = config;
+            preciseBConfig = bConfig;
+            preciseBConfig.precision = BackendConfig::Precision_Normal;
+            preciseConfig.backendConfig = &preciseBConfig;
+            sessFlowPrecise = netFlow->createSession(preciseConfig);
+            WriteLog(sessFlowPrecise ? "FP32 Flow session created" : "⚠️ FP32 Flow session unavailable");
+        }
+        return sessFlowPrecise;
+    }
+
+    // 形状从全分辨率 x_t 推出：必须是 [1, c, h, w] 且 h / w 为偶数，x_cond 与 x_t 同形；
+    // resize 未就绪或输入 / 输出元素数不是 1/4 时放弃，调用方走全分辨率路径
+    Session* getCoarseFlowSession() {
+        if (!sessFlowCoarseTried && netFlow) {
+            sessFlowCoarseTried = true;
+            Tensor* xt = netFlow->getSessionInput(sessFlow, flowSig.xt.c_str());
+            Tensor* xc = netFlow->getSessionInput(sessFlow, "x_cond");
+            auto dims = xt ? xt->shape() : std::vector<int>();
+            const bool shapeOk = dims.size() == 4 && dims[0] == 1 && dims[2] % 2 == 0 && dims[3] % 2 == 0 &&
+                                 dims[1] * dims[2] * dims[3] == flowSig.size && xc && xc->shape() == dims;
+            if (shapeOk) {
+                sessFlowCoarse = netFlow->createSession(config);
+            }
+            if (sessFlowCoarse) {
+                const std::vector<int> half = {dims[0], dims[1], dims[2] / 2, dims[3] / 2};
+                for (const char* name : {flowSig.xt.c_str(), "x_cond"}) {
+                    netFlow->resizeTensor(netFlow->getSessionInput(sessFlowCoarse, name), half);
+                }
+                netFlow->resizeSession(sessFlowCoarse);
+                int status = -1;
+                netFlow->getSessionInfo(sessFlowCoarse, Interpreter::RESIZE_STATUS, &status);
+                const int quarter = flowSig.size / 4;
+                Tensor* out = netFlow->getSessionOutput(sessFlowCoarse, flowSig.out.c_str());
+                if (status != 0 || !out || out->elementSize() != quarter ||
+                    netFlow->getSessionInput(sessFlowCoarse, flowSig.xt.c_str())->elementSize() != quarter) {
+                    WriteLog("⚠️ Coarse Flow session resize failed (status %d, output %d, expected %d)",
+                             status, out ? out->elementSize() : -1, quarter);
+                    netFlow->releaseSession(sessFlowCoarse);
+                    sessFlowCoarse = nullptr;
+                } else {
+                    coarseShape[0] = dims[1];
+                    coarseShape[1] = dims[2];
+                    coarseShape[2] = dims[3];
+                }
+            }
+            if (sessFlowCoarse) {
+                WriteLog("Coarse (%dx%d) Flow session created", coarseShape[1] / 2, coarseShape[2] / 2);
+            } else {
+                WriteLog("⚠️ Coarse Flow session unavailable");
+            }
+        }
+        return sessFlowCoarse;
+    }
+
+    // 粗分辨率积分 n 步：x 与 cond 下采样到半分辨率积分，之后把粗网格上的更新量双线性上采样
+    // 叠加回全分辨率的 x (保留初始 latent 的高频细节)；返回实际执行的步数
+    int integrateCoarse(FlowField& field, float* x, const float* cond, const RunOptions& opts,
+                        float t0, float h, int n, RunStats& stats, const std::function<bool(int)>& onStep = nullptr) {
+        const int size = field.size(), c = coarseShape[0], H = coarseShape[1], W = coarseShape[2];
+        std::vector<float> fine(size), start(size / 4), xc(size / 4), condc(size / 4);
+        field.exportCaffe(x, fine.data());
+        downsample2x(fine.data(), start.data(), c, H, W);
+        downsample2x(cond, condc.data(), c, H, W);
+        xc = start;
+        setSessionInput(netFlow.get(), sessFlowCoarse, "x_cond", condc.data());
+        setSessionInput(netFlow.get(), sessFlowCoarse, "s", &opts.style);
+
+        FlowField coarse(netFlow.get(), sessFlowCoarse, size / 4, false);
+        coarse.setReuse(opts.reuseDrift, opts.maxReuse);
+        int done = integrateFlow(coarse, xc.data(), t0, h, n, opts.solver, opts.earlyStop, opts.earlyStopMaxNorm, onStep);
+        stats.flowEvals += coarse.evals;
+        stats.reusedEvals += coarse.skipped;
+        if (coarse.aborted) {
+            // 中止时粗分辨率的增量不完整，x 保持不变；调用方按 RunGuard 的结果丢弃本次推理
+            return done;
+        }
+        for (int j = 0; j < size / 4; j++) {
+            xc[j] -= start[j];
+        }
+        upsample2xAdd(xc.data(), fine.data(), c, H / 2, W / 2);
+        field.importCaffe(fine.data(), x);
+        return done;
+    }
+
+    // 按 batch 大小新建 Session：所有输入的第 0 维 resize 为 batch
+    Session* createBatchSession(Interpreter* net, int batch) {
+        Session* sess = net->createSession(config);
+        if (!sess) return nullptr;
+        for (const auto& kv : net->getSessionInputAll(sess)) {
+            auto dims = kv.second->shape();
+            if (!dims.empty()) {
+                dims[0] = batch;
+                net->resizeTensor(kv.second, dims);
+            }
+        }
+        net->resizeSession(sess);
+        return sess;
+    }
+
+    void releaseBatchSessions(BatchSessions& bs) {
+        if (bs.enc) netEnc->releaseSession(bs.enc);
+        if (bs.flow) netFlow->releaseSession(bs.flow);
+        if (bs.dec) netDec->releaseSession(bs.dec);
+        bs = BatchSessions();
+    }
+
+    // batch 1 直接使用默认 Session；其余大小最多保留 kMaxBatchSessions 组，淘汰最久未用的一组并释放
+    // Encoder 只在 N 张不同输入批量编码时创建，Decoder 只在需要批量解码时创建 (CFG 只用 batch 2 的 Flow)
+    BatchSessions* getBatchSessions(int batch, bool withEncoder, bool withDecoder) {
+        if (batch == 1) {
+            defaultSessions.batch = 1;
+            defaultSessions.enc = sessEnc;
+            defaultSessions.flow = sessFlow;
+            defaultSessions.dec = sessDec;
+            return &defaultSessions;
+        }
+        auto it = std::find_if(batchSessions.begin(), batchSessions.end(),
+                               [batch](const BatchSessions& e) { return e.batch == batch; });
+        if (it != batchSessions.end()) {
+            std::rotate(it, it + 1, batchSessions.end());
+        } else {
+            if ((int)batchSessions.size() >= kMaxBatchSessions) {
+                releaseBatchSessions(batchSessions.front());
+                batchSessions.erase(batchSessions.begin());
+            }
+            BatchSessions bs;
+            bs.batch = batch;
+            batchSessions.push_back(bs);
+        }
+        BatchSessions& bs = batchSessions.back();
+        if (!bs.flow) {
+            bs.flow = createBatchSession(netFlow.get(), batch);
+            WriteLog(bs.flow ? "Batch %d Flow session created" : "❌ Batch %d Flow session failed", batch);
+        }
+        if (withEncoder && !bs.enc) {
+            bs.enc = createBatchSession(netEnc.get(), batch);
+            WriteLog(bs.enc ? "Batch %d Encoder session created" : "❌ Batch %d Encoder session failed", batch);
+        }
+        if (withDecoder && !bs.dec) {
+            bs.dec = createBatchSession(netDec.get(), batch);
+            WriteLog(bs.dec ? "Batch %d Decoder session created" : "❌ Batch %d Decoder session failed", batch);
+        }
+        return bs.flow && (!withEncoder || bs.enc) && (!withDecoder || bs.dec) ? &bs : nullptr;
+    }
+
+    // 批量推理：inputs 只有一张时视为多风格对比 (只编码一次，条件复制 N 份)，否则 N 张图以 batch N 编码；
+    // Flow 循环与 Decoder 以 batch N 执行
+    // styles[i] 对应 outputs[i]；像素均为已锁定的 512x512 RGBA
+    bool runBatch(const std::vector<const uint8_t*>& inputs, const std::vector<uint8_t*>& outputs,
+                  const std::vector<int>& styles, const RunOptions& opts, RunStats& stats) {
+        const int N = (int)styles.size();
+        const bool sharedInput = inputs.size() == 1;
+        ensureDefaultSessions();
+        if (!sessEnc || !sessFlow || !sessDec || N == 0 || (int)outputs.size() != N ||
+            (!sharedInput && (int)inputs.size() != N)) {
+            WriteLog("❌ Sessions not ready or input / style / bitmap count mismatch");
+            return false;
+        }
+        if (customFlow()) {
+            WriteLog("❌ Batch path needs the standard Flow signature and uniform grid");
+            return false;
+        }
+        BatchSessions* bs = getBatchSessions(N, !sharedInput, true);
+        if (!bs) {
+            WriteLog("❌ Failed to create batch %d sessions", N);
+            return false;
+        }
+        Session* flowSess = bs->flow;
+
+        stats.batch = N;
+        auto t_all_start = std::chrono::high_resolution_clock::now();
+        int safe_steps = flowSchedule.steps > 0 ? flowSchedule.steps : std::max(1, std::min(opts.steps, 50));
+        float fixed_dt = flowSchedule.dt;
+        int solver_steps = opts.solverSteps > 0 ? std::min(opts.solverSteps, safe_steps) : safe_steps;
+        float h = (float)safe_steps * fixed_dt / (float)solver_steps;
+        const int size = 1 * 4 * 64 * 64;
+        std::vector<float> cond(N * size);
+
+        // --- STEP 1: ENCODER ---
+        Session* encSess = sharedInput ? sessEnc : bs->enc;
+        auto tEncIn = netEnc->getSessionInput(encSess, "input");
+        if (sharedInput) {
+            convertInput(inputs[0], tEncIn);
+        } else {
+            // 逐张转换到 batch 张量的对应切片，再一次性上传
+            std::unique_ptr<Tensor> hEncIn(new Tensor(tEncIn, Tensor::CAFFE));
+            const int image_size = 3 * 512 * 512;
+            for (int i = 0; i < N; i++) {
+                std::unique_ptr<Tensor> slice(Tensor::create<float>({1, 3, 512, 512},
+                                                                    hEncIn->host<float>() + i * image_size, Tensor::CAFFE));
+                convertInput(inputs[i], slice.get());
+            }
+            tEncIn->copyFromHostTensor(hEncIn.get());
+        }
+        netEnc->runSession(encSess);
+        auto tEncOut = netEnc->getSessionOutput(encSess, "output");
+        std::unique_ptr<Tensor> hCond(new Tensor(tEncOut, Tensor::CAFFE));
+        tEncOut->copyToHostTensor(hCond.get());
+        for (int i = 0; i < N; i++) {
+            memcpy(cond.data() + i * size, hCond->host<float>() + (sharedInput ? 0 : i * size), size * sizeof(float));
+        }
+        stats.encMs = elapsedMs(t_all_start);
+
+        // --- STEP 2: FLOW LOOP (batch N) ---
+        auto t_flow_start = std::chrono::high_resolution_clock::now();
+        setSessionInput(netFlow.get(), flowSess, "x_cond", cond.data());
+        setSessionInput(netFlow.get(), flowSess, "s", styles.data());
+
+        FlowField field(netFlow.get(), flowSess, N * size, opts.nativeLayout);
+        field.setReuse(opts.reuseDrift, opts.maxReuse);
+        stats.nativeLayout = field.nativeLayout();
+        std::vector<float> latents(N * size);
+        float* x = latents.data();
+        field.importCaffe(cond.data(), x);
+        if (opts.solver == FlowSolver::Adaptive) {
+            integrateAdaptive(field, x, 0.0f, (float)safe_steps * fixed_dt, h, std::max(opts.tolerance, 1e-6f), stats);
+            solver_steps = stats.accepted;
+            stats.executedSteps = solver_steps;
+        } else {
+            stats.executedSteps = integrateFlow(field, x, 0.0f, h, solver_steps, opts.solver,
+                                                opts.earlyStop, opts.earlyStopMaxNorm);
+        }
+        stats.solver = opts.solver;
+        stats.steps = safe_steps;
+        stats.solverSteps = solver_steps;
+        stats.flowEvals = field.evals;
+        stats.reusedEvals = field.skipped;
+        stats.flowMs = elapsedMs(t_flow_start);
+
+        // --- STEP 3: DECODER (batch N) ---
+        auto t_dec_start = std::chrono::high_resolution_clock::now();
+        auto dIn = netDec->getSessionInput(bs->dec, "input");
+        std::unique_ptr<Tensor> hDecIn(new Tensor(dIn, Tensor::CAFFE));
+        field.exportCaffe(x, hDecIn->host<float>());
+        dIn->copyFromHostTensor(hDecIn.get());
+        netDec->runSession(bs->dec);
+        auto dOut = netDec->getSessionOutput(bs->dec, "output");
+        std::unique_ptr<Tensor> hFinal(new Tensor(dOut, Tensor::CAFFE));
+        dOut->copyToHostTensor(hFinal.get());
+
+        // --- STEP 4: OUTPUT RENDER ---
+        const int image_size = 3 * 512 * 512;
+        for (int i = 0; i < N; i++) {
+            renderRGBA(hFinal->host<float>() + i * image_size, outputs[i]);
+        }
+
+        stats.decMs = elapsedMs(t_dec_start);
+        stats.totalMs = elapsedMs(t_all_start);
+        return true;
+    }
+
+    // 锁定位图后调用 runBatch；ins 为一张时是多风格对比，否则与 outs 一一对应
+    bool runBatch(JNIEnv* env, const std::vector<jobject>& ins, const std::vector<jobject>& outs,
+                  const std::vector<int>& styles, const RunOptions& opts) {
+        std::vector<const uint8_t*> inPixels;
+        std::vector<uint8_t*> outPixels;
+        for (jobject bmp : ins) {
+            void* pixels = nullptr;
+            AndroidBitmap_lockPixels(env, bmp, &pixels);
+            inPixels.push_back((const uint8_t*)pixels);
+        }
+        for (jobject bmp : outs) {
+            void* pixels = nullptr;
+            AndroidBitmap_lockPixels(env, bmp, &pixels);
+            outPixels.push_back((uint8_t*)pixels);
+        }
+        RunStats stats;
+        bool ok = runBatch(inPixels, outPixels, styles, opts, stats);
+        for (jobject bmp : ins) {
+            AndroidBitmap_unlockPixels(env, bmp);
+        }
+        for (jobject bmp : outs) {
+            AndroidBitmap_unlockPixels(env, bmp);
+        }
+        if (ok) {
+            lastStats = stats;
+            WriteLog("Success (batch %d, %s): %s", (int)styles.size(), ins.size() == 1 ? "styles" : "images",
+                     stats.summary().c_str());
+        }
+        return ok;
+    }
+
+    // 分阶段流水线批量推理：Encoder / Flow / Decoder 各一个线程，经容量为 2 的有界队列传递 latent，
+    // 不同图的三个阶段同时运行，稳态吞吐趋近 1 / max(阶段耗时)。Flow 只走完整图 (不用切分 / 派生图)；
+    // 取消 / 时间预算对每个阶段生效 (截止时间从调用开始算)，中止后未完成的图被丢弃，已完成的图仍写入输出
+    bool runStagePipeline(const std::vector<const uint8_t*>& inputs, const std::vector<uint8_t*>& outputs,
+                          const RunOptions& opts) {
+        ensureDefaultSessions();
+        StageSessions* st = sessEnc && sessFlow && sessDec && latentShapesMatch() ? getStageSessions() : nullptr;
+        if (!st || inputs.empty() || inputs.size() != outputs.size()) return false;
+        const int size = flowSig.size;
+        const int safe_steps = flowSchedule.steps > 0 ? flowSchedule.steps : std::max(1, std::min(opts.steps, 50));
+        const int solver_steps = opts.solverSteps > 0 ? std::min(opts.solverSteps, safe_steps) : safe_steps;
+        const float h = (float)safe_steps * flowSchedule.dt / (float)solver_steps;
+
+        struct Item {
+            int index = 0;
+            std::vector<float> cond, x;
+        };
+        BoundedQueue<Item> toFlow(2), toDec(2);
+        std::atomic<bool> aborted(false);
+        float busyMs[3] = {0, 0, 0};
+        int processed[3] = {0, 0, 0}; // 各阶段完成的图数，中止时小于 N
+        auto t_all_start = std::chrono::high_resolution_clock::now();
+        const auto deadline = std::chrono::steady_clock::now() +
+                              std::chrono::microseconds((long long)(opts.deadlineMs * 1000.0f));
+        // 每个阶段线程各自的 RunGuard：共用取消标志与同一个截止时间，逐算子检查
+        auto stage = [&](const std::function<void(RunGuard&)>& body) {
+            return std::thread([&, body] {
+                RunGuard guard;
+                guard.cancel = opts.cancelFlag;
+                guard.hasDeadline = opts.deadlineMs > 0.0f;
+                guard.deadline = deadline;
+                RunGuardScope guardScope(&guard);
+                body(guard);
+                if (guard.reason != RunGuard::None) aborted = true;
+            });
+        };
+
+        std::thread enc = stage([&](RunGuard&) {
+            Interpreter* net = st->net[0];
+            Tensor* tIn = net->getSessionInput(st->sess[0], "input");
+            Tensor* tOut = net->getSessionOutput(st->sess[0], "output");
+            std::unique_ptr<Tensor> hOut(new Tensor(tOut, Tensor::CAFFE));
+            for (int i = 0; i < (int)inputs.size() && !aborted; i++) {
+                auto t0 = std::chrono::high_resolution_clock::now();
+                convertInput(inputs[i], tIn);
+                if (!runChecked(net, st->sess[0])) break;
+                tOut->copyToHostTensor(hOut.get());
+                Item item;
+                item.index = i;
+                item.cond.assign(hOut->host<float>(), hOut->host<float>() + size);
+                busyMs[0] += elapsedMs(t0);
+                processed[0]++;
+                toFlow.push(std::move(item));
+            }
+            toFlow.close();
+        });
+
+        std::thread flow = stage([&](RunGuard& guard) {
+            FlowField field(netFlow.get(), st->sess[1], size, opts.nativeLayout, flowSig);
+            std::vector<float> x(size);
+            Item item;
+            while (toFlow.pop(item)) {
+                if (aborted) continue; // 继续取空队列，上游不会阻塞在 push 上
+                auto t0 = std::chrono::high_resolution_clock::now();
+                if (!flowSig.cond.empty()) {
+                    setSessionInput(netFlow.get(), st->sess[1], flowSig.cond.c_str(), item.cond.data());
+                }
+                if (!flowSig.s.empty()) {
+                    setSessionInput(netFlow.get(), st->sess[1], flowSig.s.c_str(), &opts.style);
+                }
+                field.importCaffe(item.cond.data(), x.data());
+                auto hook = [&](int) { return !guard.check(); };
+                const auto& ts = flowSchedule.timesteps;
+                if (!ts.empty()) {
+                    for (int i = 0; i + 1 < (int)ts.size() && hook(i); i++) {
+                        integrateFlow(field, x.data(), ts[i], ts[i + 1] - ts[i], 1, opts.solver);
+                    }
+                } else if (opts.solver == FlowSolver::Adaptive) {
+                    RunStats local;
+                    integrateAdaptive(field, x.data(), 0.0f, (float)safe_steps * flowSchedule.dt, h,
+                                      std::max(opts.tolerance, 1e-6f), local, hook);
+                } else {
+                    integrateFlow(field, x.data(), 0.0f, h, solver_steps, opts.solver, 0.0f, false, hook);
+                }
+                if (guard.check()) {
+                    aborted = true;
+                    continue;
+                }
+                item.x.resize(size);
+                field.exportCaffe(x.data(), item.x.data());
+                busyMs[1] += elapsedMs(t0);
+                processed[1]++;
+                toDec.push(std::move(item));
+            }
+            toDec.close();
+        });
+
+        std::thread dec = stage([&](RunGuard&) {
+            Interpreter* net = st->net[2];
+            Tensor* tOut = net->getSessionOutput(st->sess[2], "output");
+            std::unique_ptr<Tensor> hOut(new Tensor(tOut, Tensor::CAFFE));
+            Item item;
+            while (toDec.pop(item)) {
+                if (aborted) continue;
+                auto t0 = std::chrono::high_resolution_clock::now();
+                setSessionInput(net, st->sess[2], "input", item.x.data());
+                if (!runChecked(net, st->sess[2])) continue;
+                tOut->copyToHostTensor(hOut.get());
+                renderRGBA(hOut->host<float>(), outputs[item.index]);
+                busyMs[2] += elapsedMs(t0);
+                processed[2]++;
+            }
+        });
+        enc.join();
+        flow.join();
+        dec.join();
+
+        // 吞吐与每图耗时按实际完成的图数计算，中止时不按 N 摊薄
+        const float wallMs = elapsedMs(t_all_start);
+        const int N = (int)inputs.size();
+        const int completed = processed[2];
+        float perImage[3];
+        for (int k = 0; k < 3; k++) {
+            perImage[k] = processed[k] > 0 ? busyMs[k] / processed[k] : 0.0f;
+        }
+        const float maxMs = std::max(perImage[0], std::max(perImage[1], perImage[2]));
+        const float sumMs = perImage[0] + perImage[1] + perImage[2];
+        char buf[512];
+        int n = snprintf(buf, sizeof(buf), "stage pipeline (%d/%d images, steps=%d%s): %.2fimg/s", completed, N,
+                         safe_steps, aborted ? ", aborted" : "", completed * 1000.0f / wallMs);
+        const char* names[3] = {"enc", "flow", "dec"};
+        for (int k = 0; k < 3; k++) {
+            n += snprintf(buf + n, sizeof(buf) - n, " %s=[%s] %.1fms/img util=%.0f%%", names[k],
+                          coreList(st->cores[k]).c_str(), perImage[k], 100.0f * busyMs[k] / wallMs);
+        }
+        snprintf(buf + n, sizeof(buf) - n, " bound=%.2fimg/s serial=%.2fimg/s",
+                 maxMs > 0 ? 1000.0f / maxMs : 0.0f, sumMs > 0 ? 1000.0f / sumMs : 0.0f);
+        lastPipelineReport = buf;
+        WriteLog("%s", buf);
+        return !aborted;
+    }
+
+    bool runStagePipeline(JNIEnv* env, const std::vector<jobject>& ins, const std::vector<jobject>& outs,
+                          const RunOptions& opts) {
+        std::vector<const uint8_t*> inPixels;
+        std::vector<uint8_t*> outPixels;
+        for (jobject bmp : ins) {
+            void* pixels = nullptr;
+            AndroidBitmap_lockPixels(env, bmp, &pixels);
+            inPixels.push_back((const uint8_t*)pixels);
+        }
+        for (jobject bmp : outs) {
+            void* pixels = nullptr;
+            AndroidBitmap_lockPixels(env, bmp, &pixels);
+            outPixels.push_back((uint8_t*)pixels);
+        }
+        bool ok = runStagePipeline(inPixels, outPixels, opts);
+        for (jobject bmp : ins) {
+            AndroidBitmap_unlockPixels(env, bmp);
+        }
+        for (jobject bmp : outs) {
+            AndroidBitmap_unlockPixels(env, bmp);
+        }
+        return ok;
+    }
+
+    // 吞吐基准：同一张图复制成 batch 1/2/4/8 各跑 iters 次 (Encoder / Flow / Decoder 都以 batch N 运行)，报告 images/s
+    // 每个 batch 先预热一次 (创建 Session)，不计入耗时
+    std::string benchmarkBatchThroughput(const uint8_t* pixels, int style, int steps, int iters) {
+        iters = std::max(1, iters);
+        RunOptions opts;
+        opts.style = style;
+        opts.steps = steps;
+        std::string report = "batch throughput (enc/flow/dec at batch N, steps=" + std::to_string(steps) + "):";
+        std::vector<uint8_t> scratch(8 * 512 * 512 * 4);
+        for (int N : {1, 2, 4, 8}) {
+            std::vector<const uint8_t*> ins(N, pixels);
+            std::vector<uint8_t*> outs;
+            for (int i = 0; i < N; i++) {
+                outs.push_back(scratch.data() + i * 512 * 512 * 4);
+            }
+            std::vector<int> styles(N, style);
+            RunStats stats;
+            if (!runBatch(ins, outs, styles, opts, stats)) {
+                report += " batch" + std::to_string(N) + "=failed";
+                break;
+            }
+            auto t0 = std::chrono::high_resolution_clock::now();
+            for (int it = 0; it < iters; it++) {
+                runBatch(ins, outs, styles, opts, stats);
+            }
+            float ms = elapsedMs(t0);
+            char buf[96];
+            snprintf(buf, sizeof(buf), " batch%d=%.2fimg/s(%.0fms/img)", N, N * iters * 1000.0f / ms, ms / (N * iters));
+            report += buf;
+        }
+        WriteLog("%s", report.c_str());
+        return report;
+    }
+
+    // 会话池吞吐：iters 个请求先逐个提交 (串行基线)，再由与槽位数相同的线程并发提交
+    std::string benchmarkSessionPool(const uint8_t* pixels, int style, int steps, int iters) {
+        auto pool = getSessionPool();
+        if (!pool) return "session pool unavailable";
+        iters = std::max(1, iters);
+        RunOptions opts;
+        opts.style = style;
+        opts.steps = steps;
+        std::vector<uint8_t> scratch(poolSlots * 512 * 512 * 4);
+        RunStats warm;
+        if (!pool->run(pixels, scratch.data(), opts, warm)) return "session pool run failed";
+
+        auto t0 = std::chrono::high_resolution_clock::now();
+        for (int it = 0; it < iters; it++) {
+            RunStats stats;
+            pool->run(pixels, scratch.data(), opts, stats);
+        }
+        float serialMs = elapsedMs(t0);
+
+        std::atomic<int> next(0);
+        std::vector<std::thread> workers;
+        t0 = std::chrono::high_resolution_clock::now();
+        for (int w = 0; w < poolSlots; w++) {
+            workers.emplace_back([&, w] {
+                while (next.fetch_add(1) < iters) {
+                    RunStats stats;
+                    pool->run(pixels, scratch.data() + w * 512 * 512 * 4, opts, stats);
+                }
+            });
+        }
+        for (auto& t : workers) t.join();
+        float concurrentMs = elapsedMs(t0);
+
+        char buf[256];
+        snprintf(buf, sizeof(buf), "session pool (steps=%d, %d requests): serial=%.2fimg/s concurrent=%.2fimg/s speedup=%.2fx [%s]",
+                 steps, iters, iters * 1000.0f / serialMs, iters * 1000.0f / concurrentMs, serialMs / concurrentMs,
+                 pool->stats().c_str());
+        WriteLog("%s", buf);
+        return buf;
+    }
+
+    // 位图入口：输入先拷贝出来即解锁，输出只在成功时写回位图
+    bool run(JNIEnv* env, jobject inBmp, jobject outBmp, const RunOptions& opts) {
+        void* pixels = nullptr;
+        AndroidBitmap_lockPixels(env, inBmp, &pixels);
+        std::vector<uint8_t> input((const uint8_t*)pixels, (const uint8_t*)pixels + 512 * 512 * 4);
+        AndroidBitmap_unlockPixels(env, inBmp);
+        std::vector<uint8_t> output(input.size());
+        if (!runPixels(input.data(), output.data(), opts)) {
+            return false;
+        }
+        AndroidBitmap_lockPixels(env, outBmp, &pixels);
+        memcpy(pixels, output.data(), output.size());
+        AndroidBitmap_unlockPixels(env, outBmp);
+        return true;
+    }
+
+    // input / output 为 512x512 RGBA；取消 (opts.onStep 返回 false) 时返回 false，output 不写入
+    bool runPixels(const uint8_t* input, uint8_t* output, const RunOptions& opts) {
+        ensureDefaultSessions();
+        if (!sessEnc || !sessFlow || !sessDec) {
+            WriteLog("❌ Sessions not ready");
+            return false;
+        }
+        if (!latentShapesMatch()) {
+            return false;
+        }
+        // null style 的编号随模型而定，没有可靠的默认值：猜错会越界读取风格嵌入表，因此未指定时拒绝 CFG 请求
+        if (opts.guidance > 0.0f && opts.nullStyle < 0) {
+            WriteLog("❌ guidance=%.2f needs an explicit nullStyle (the model's null style id), request rejected", opts.guidance);
+            return false;
+        }
+
+        RunStats stats;
+        auto t_all_start = std::chrono::high_resolution_clock::now();
+
+        // 取消 / 时间预算：opCancel 时各 runSession 逐算子检查，否则只在 Flow 步边界检查
+        RunGuard guard;
+        guard.cancel = opts.cancelFlag;
+        if (opts.deadlineMs > 0.0f) {
+            guard.hasDeadline = true;
+            guard.deadline = std::chrono::steady_clock::now() +
+                             std::chrono::microseconds((long long)(opts.deadlineMs * 1000.0f));
+        }
+        RunGuardScope guardScope(opts.opCancel ? &guard : nullptr);
+        // 中止：不写输出，Session 保持可用；取消与超时在统计中区分
+        auto abortRun = [&](const char* stage) {
+            stats.deadlineExceeded = guard.reason == RunGuard::Deadline;
+            stats.cancelled = !stats.deadlineExceeded;
+            stats.totalMs = elapsedMs(t_all_start);
+            lastStats = stats;
+            WriteLog("Aborted in %s: %s", stage, stats.summary().c_str());
+            return false;
+        };
+
+        // 动态步数控制 (限制在 1~50 之间防止死机)；调度描述给出步数时以模型为准
+        int safe_steps = flowSchedule.steps > 0 ? flowSchedule.steps : std::max(1, std::min(opts.steps, 50));
+        // 步长默认固定 0.05：steps 决定积分终点 T = steps * dt，steps 越多效果越强/变化越大
+        float fixed_dt = flowSchedule.dt;
+        // 高阶积分器可用更少的区间到达同一终点：h = T / solverSteps
+        int solver_steps = opts.solverSteps > 0 ? std::min(opts.solverSteps, safe_steps) : safe_steps;
+        float h = (float)safe_steps * fixed_dt / (float)solver_steps;
+        const bool custom = customFlow();
+        // 单步法在固定网格上前 k 步与 k 步推理完全一致，可以从缓存继续
+        // fp32Steps 是末尾 k 步，哪几步走 FP32 随总步数变化，前缀不再一致，不能续算；
+        // 速度复用依赖上一次真实调用的状态，续算时状态已丢失，结果与从头计算不同，同样不能续算
+        bool resumable = solver_steps == safe_steps && flowSchedule.timesteps.empty() && opts.fp32Steps <= 0 &&
+                         opts.reuseDrift <= 0.0f &&
+                         opts.solver != FlowSolver::AdamsBashforth && opts.solver != FlowSolver::Adaptive;
+
+        // 整图流水线：只覆盖固定网格上的纯 Euler，不经过轨迹缓存；不可用时走下面的三会话路径
+        // 一次 onForward 无法中途停下，有取消标志或时间预算时也走三会话路径
+        if (opts.wholeGraph && !custom && !guard.active() && opts.solver == FlowSolver::Euler && solver_steps == safe_steps &&
+            opts.guidance <= 0.0f && opts.fp32Steps <= 0 && opts.coarseSteps <= 0 &&
+            opts.earlyStop <= 0.0f && opts.reuseDrift <= 0.0f) {
+            if (runPipeline(input, output, opts.style, safe_steps, stats)) {
+                stats.solver = opts.solver;
+                stats.steps = safe_steps;
+                stats.solverSteps = solver_steps;
+                stats.totalMs = elapsedMs(t_all_start);
+                lastStats = stats;
+                WriteLog("Success: %s", stats.summary().c_str());
+                return true;
+            }
+        }
+
+        // --- STEP 1: ENCODER ---
+        auto tEncIn = netEnc->getSessionInput(sessEnc, "input");
+
+        uint64_t key = trajectoryKey(input, 512 * 512 * 4, opts.style, opts.solver);
+        if (opts.coarseSteps > 0) {
+            key = fnv1a((const uint8_t*)&opts.coarseSteps, sizeof(int), key);
+        }
+        if (opts.guidance > 0.0f) {
+            key = fnv1a((const uint8_t*)&opts.guidance, sizeof(float), fnv1a((const uint8_t*)&opts.nullStyle, sizeof(int), key));
+        }
+        // 粗分辨率前缀必须在一段内连续积分完：缓存停在前缀中途 (全分辨率 latent) 时不续算，视为未命中
+        Trajectory* cached = resumable ? findTrajectory(key, safe_steps, std::max(0, opts.coarseSteps)) : nullptr;
+        if (!cached) {
+            convertInput(input, tEncIn);
+        }
+
+        int size = flowSig.size; // 标准模型为 [1, 4, 64, 64]
+        auto fXc = flowSig.cond.empty() ? nullptr : netFlow->getSessionInput(sessFlow, flowSig.cond.c_str());
+        auto fS = flowSig.s.empty() ? nullptr : netFlow->getSessionInput(sessFlow, flowSig.s.c_str());
+        // 没有 x_cond 输入的模型 (如一致性模型) 只用 Encoder 输出作初始 latent
+        std::unique_ptr<Tensor> hostL(new Tensor(netEnc->getSessionOutput(sessEnc, "output"), Tensor::CAFFE));
 
-    SAFlowEngine(const std::string& path) {
-        g_log_path = path + "/sa_debug.txt";
-        // 每次初始化清空旧日志
-        std::ofstream(g_log_path, std::ios::trunc).close();
+        int start_step = 0;
+        if (cached) {
+            // 命中：跳过 Encoder，从上次停下的步继续
+            memcpy(hostL->host<float>(), cached->cond.data(), size * sizeof(float));
+            start_step = cached->step;
+            stats.resumedFrom = start_step;
+        } else {
+            if (!runChecked(netEnc.get(), sessEnc)) {
+                return abortRun("Encoder");
+            }
+            auto tEncOut = netEnc->getSessionOutput(sessEnc, "output");
 
-        WriteLog("=== ENGINE INIT: CPU SAFE MODE ===");
-        WriteLog("Model Path: %s", path.c_str());
+            // Copy Encoder Output -> CPU
+            tEncOut->copyToHostTensor(hostL.get());
+        }
+        stats.encMs = elapsedMs(t_all_start);
 
-        // --- CPU 优化配置 ---
-        ScheduleConfig config;
-        config.type = MNN_FORWARD_CPU; // 强制 CPU
-        config.numThread = 4;          // 4线程平衡性能与发热
+        // --- STEP 2: FLOW LOOP ---
+        auto t_flow_start = std::chrono::high_resolution_clock::now();
 
-        BackendConfig bConfig;
-        bConfig.precision = BackendConfig::Precision_Low; // 开启 FP16 (ARMv8.2+)
-        bConfig.power = BackendConfig::Power_High;        // 倾向使用大核
-        bConfig.memory = BackendConfig::Memory_High;      // 空间换时间
-        config.backendConfig = &bConfig;
+        // CFG：条件 / 无条件两个分支放进 batch 2 的同一次 runSession，只走完整 Flow 图
+        BatchSessions* guidedSessions = opts.guidance > 0.0f && !custom ? getBatchSessions(2, false, false) : nullptr;
+        Session* guided = guidedSessions ? guidedSessions->flow : nullptr;
+        if (opts.guidance > 0.0f && !guided) {
+            WriteLog("⚠️ Batch 2 Flow session unavailable, guidance disabled");
+        }
 
-        // 加载 Encoder
-        netEnc.reset(Interpreter::createFromFile((path + "/Encoder.mnn").c_str()));
-        if (netEnc) {
-            sessEnc = netEnc->createSession(config);
-            netEnc->releaseModel(); // 释放模型Buffer以节省内存
+        // Express 路径只支持 Euler，且不支持速度复用（速度不再离开图）
+        Module* stepModule = !guided && !custom && opts.expressStep && opts.solver == FlowSolver::Euler && opts.reuseDrift <= 0.0f
+                                 ? getEulerModule() : nullptr;
+
+        // K 步展开：t 固化在图里，只用于固定网格的 Euler，且不做逐步的提前结束判断
+        std::vector<Module*> unrollPlan;
+        if (!guided && !custom && opts.unroll > 1 && opts.solver == FlowSolver::Euler && opts.reuseDrift <= 0.0f &&
+            opts.earlyStop <= 0.0f) {
+            unrollPlan = planUnrolled(opts.unroll, solver_steps - start_step);
+        }
+        const bool useModule = stepModule || !unrollPlan.empty();
+
+        // 风格特化：s 已固化在图里，省去每步的风格嵌入计算与 s 的上传
+        StyleFlow* styleFlow = opts.styleGraph && !useModule && !guided && !custom ? getStyleFlow(opts.style) : nullptr;
+        Interpreter* flowNet = styleFlow ? styleFlow->net.get() : netFlow.get();
+        Session* flowSess = styleFlow ? styleFlow->sess : sessFlow;
+        float stepFlops = styleFlow ? styleFlow->flops : flowFlops;
+
+        // condition 缓存：x_cond / s 分支每图只算一次，每步只跑依赖 x_t / t 的子网
+        // 时间嵌入表：网格上的 t 直接把预先算好的 temb_k 写入 loop 子网，不再跑时间嵌入 MLP
+        FlowSplit* split = nullptr;
+        if ((opts.condCache || opts.timeTable) && !useModule && !guided) {
+            split = styleFlow ? styleFlow->split.get() : flowSplit.get();
+        }
+        if (guided) {
+            flowSess = guided;
+            std::vector<float> cond2(2 * size);
+            memcpy(cond2.data(), hostL->host<float>(), size * sizeof(float));
+            memcpy(cond2.data() + size, hostL->host<float>(), size * sizeof(float));
+            int s2[2] = {opts.style, opts.nullStyle};
+            setSessionInput(flowNet, flowSess, "x_cond", cond2.data());
+            setSessionInput(flowNet, flowSess, "s", s2);
+        } else if (split) {
+            runCondSplit(*split, hostL->host<float>(), opts.style);
+            flowNet = split->loop.net.get();
+            flowSess = split->loop.sess;
+            stepFlops = split->loop.flops;
+        } else if (styleFlow) {
+            // 设置 Condition (Encoder output)
+            setSessionInput(flowNet, flowSess, "x_cond", hostL->host<float>());
         } else {
-            WriteLog("❌ Failed to load Encoder.mnn");
+            // 设置 Condition (Encoder output)
+            if (fXc) {
+                fXc->copyFromHostTensor(hostL.get());
+            }
+
+            // 设置 Style ID：按 s 的实际类型写入 (float 的 s 输入同样经 setSessionInput 转换)
+            if (fS && fS->elementSize() == 1) {
+                setSessionInput(flowNet, flowSess, flowSig.s, &opts.style);
+            } else if (fS) {
+                WriteLog("⚠️ Flow input '%s' has %d elements, style id left unset", flowSig.s.c_str(), fS->elementSize());
+            }
         }
 
-        // 加载 Flow (注意：这里会读取最新的 Flow.mnn)
-        netFlow.reset(Interpreter::createFromFile((path + "/Flow.mnn").c_str()));
-        if (netFlow) {
-            sessFlow = netFlow->createSession(config);
-            netFlow->releaseModel();
+        FlowField field(flowNet, flowSess, size, opts.nativeLayout && !useModule && !guided, flowSig);
+        // condCache 关闭而只为时间嵌入表走切分路径时，cond 分支照常每次调用都算 (首次调用已由 runCondSplit 算过)
+        const bool condPerEval = split && !opts.condCache && split->cond.net;
+        if (split && (split->time.net || condPerEval)) {
+            const bool useTable = opts.timeTable;
+            bool first = true;
+            field.setTimeFeed([this, split, useTable, condPerEval, first](float t) mutable {
+                if (condPerEval && !first) runCondFeatures(*split);
+                first = false;
+                feedTime(*split, t, useTable);
+            });
+        }
+        if (guided) {
+            field.setGuidance(opts.guidance);
+            stats.guidance = opts.guidance;
+        } else if (opts.solver != FlowSolver::Adaptive) {
+            field.setReuse(opts.reuseDrift, opts.maxReuse);
+        }
+        stats.nativeLayout = field.nativeLayout();
+
+        // 准备 Latent：Euler 且 x_t 可直接访问时，latent 就存放在 Session 的 x_t 内存里原地更新，
+        // 每步只剩 runSession + 一次融合的 x += v * dt
+        std::vector<float> latents;
+        float* x = opts.solver == FlowSolver::Euler && !useModule ? field.directInput() : nullptr;
+        if (!x) {
+            latents.resize(size);
+            x = latents.data();
+        }
+        field.importCaffe(cached ? cached->latent.data() : hostL->host<float>(), x);
+
+        // 步边界回调：base 为该积分段之前已完成的步数，回调返回 false 或中止条件成立即停止
+        bool cancelled = false;
+        auto stepHook = [&](int base) -> std::function<bool(int)> {
+            if (!opts.onStep && !guard.active()) return nullptr;
+            return [&, base](int done) {
+                cancelled = (opts.onStep && !opts.onStep(base + done, solver_steps)) || guard.check();
+                return !cancelled;
+            };
+        };
+
+        if (!unrollPlan.empty()) {
+            int done = runUnrolled(unrollPlan, x, hostL->host<float>(), opts.style, (float)start_step * h, h,
+                                   opts.unroll, solver_steps - start_step, stepHook(start_step));
+            stats.executedSteps = start_step + done;
+            stats.flowEvals = done;
+            stats.unroll = opts.unroll;
+            stats.dispatches = (int)unrollPlan.size();
+            stats.expressStep = true;
+            if (stats.executedSteps < solver_steps && !cancelled) {
+                // 展开的 Module 中途失败：剩余步数回退到完整 Flow 图 (x 为 CAFFE 排布，field 未启用原生排布)
+                stats.executedSteps += integrateFlow(field, x, (float)stats.executedSteps * h, h, solver_steps - stats.executedSteps,
+                                                     FlowSolver::Euler, 0.0f, false, stepHook(stats.executedSteps));
+            }
+        } else if (stepModule) {
+            stats.executedSteps = start_step + runExpressEuler(stepModule, x, hostL->host<float>(), opts.style,
+                                                               (float)start_step * h, h, solver_steps - start_step,
+                                                               opts.earlyStop, opts.earlyStopMaxNorm, stepHook(start_step));
+            stats.flowEvals = stats.executedSteps - start_step;
+            stats.expressStep = true;
+            if (stats.executedSteps < solver_steps && !cancelled && opts.earlyStop <= 0.0f) {
+                // Module 中途没有输出：剩余步数回退到完整 Flow 图 (开启 earlyStop 时步数不足可能是提前结束，不回退)
+                stats.executedSteps += integrateFlow(field, x, (float)stats.executedSteps * h, h, solver_steps - stats.executedSteps,
+                                                     FlowSolver::Euler, 0.0f, false, stepHook(stats.executedSteps));
+            }
+        } else if (!flowSchedule.timesteps.empty()) {
+            // 非均匀网格：逐区间积分，区间内仍使用所选 solver (多步法退化为各区间独立起步)
+            const auto& ts = flowSchedule.timesteps;
+            auto hook = stepHook(0);
+            solver_steps = (int)ts.size() - 1;
+            while (stats.executedSteps < solver_steps && !cancelled) {
+                const int i = stats.executedSteps;
+                if (integrateFlow(field, x, ts[i], ts[i + 1] - ts[i], 1, opts.solver) < 1) break;
+                stats.executedSteps++;
+                if (hook) hook(i + 1);
+            }
+        } else if (opts.solver == FlowSolver::Adaptive) {
+            // 初始步长取 h，之后由误差估计决定；solverSteps 记录实际接受的步数
+            integrateAdaptive(field, x, 0.0f, (float)safe_steps * fixed_dt, h, std::max(opts.tolerance, 1e-6f), stats,
+                              stepHook(0));
+            solver_steps = stats.accepted;
+            stats.executedSteps = solver_steps;
         } else {
-            WriteLog("❌ Failed to load Flow.mnn");
+            // 分辨率 / 精度调度：前 coarseSteps 步在半分辨率 latent 上积分，中段为默认 (FP16) Session，
+            // 最后 fp32Steps 步切到 Precision_Normal 的 Session
+            const int n = solver_steps - start_step;
+            const bool multistep = opts.solver == FlowSolver::AdamsBashforth;
+            const int hi = !guided && !custom && !multistep && opts.fp32Steps > 0 && getPreciseFlowSession()
+                               ? std::min(opts.fp32Steps, n) : 0;
+            const int lo = !guided && !custom && !multistep && opts.coarseSteps > start_step && getCoarseFlowSession()
+                               ? std::min(opts.coarseSteps - start_step, n - hi) : 0;
+            int step = start_step;
+            if (lo > 0) {
+                stats.coarseSteps = integrateCoarse(field, x, hostL->host<float>(), opts, (float)step * h, h, lo, stats,
+                                                    stepHook(step));
+                step += stats.coarseSteps;
+            }
+            stats.executedSteps = step;
+            if (stats.coarseSteps == lo && !cancelled) {
+                stats.executedSteps += integrateFlow(field, x, (float)step * h, h, n - hi - lo,
+                                                     opts.solver, opts.earlyStop, opts.earlyStopMaxNorm, stepHook(step));
+            }
+            stats.fp16Steps = stats.executedSteps - step;
+            if (hi > 0 && stats.executedSteps == solver_steps - hi && !cancelled) {
+                setSessionInput(netFlow.get(), sessFlowPrecise, "x_cond", hostL->host<float>());
+                setSessionInput(netFlow.get(), sessFlowPrecise, "s", &opts.style);
+                FlowField precise(netFlow.get(), sessFlowPrecise, size, false);
+                precise.setReuse(opts.reuseDrift, opts.maxReuse);
+                std::vector<float> xp(size);
+                field.exportCaffe(x, xp.data());
+                int done = integrateFlow(precise, xp.data(), (float)stats.executedSteps * h, h, hi,
+                                         opts.solver, opts.earlyStop, opts.earlyStopMaxNorm, stepHook(stats.executedSteps));
+                field.importCaffe(xp.data(), x);
+                stats.executedSteps += done;
+                stats.fp32Steps = done;
+                stats.flowEvals += precise.evals;
+                stats.reusedEvals += precise.skipped;
+            }
         }
 
-        // 加载 Decoder
-        netDec.reset(Interpreter::createFromFile((path + "/Decoder.mnn").c_str()));
-        if (netDec) {
-            sessDec = netDec->createSession(config);
-            netDec->releaseModel();
+        stats.solver = opts.solver;
+        stats.steps = safe_steps;
+        stats.solverSteps = solver_steps;
+        stats.flowEvals += field.evals;
+        stats.reusedEvals += field.skipped;
+        stats.condCache = split && split->cond.net && opts.condCache;
+        stats.styleGraph = styleFlow != nullptr;
+        if (split || styleFlow) {
+            stats.flopsSaved = (float)field.evals * (flowFlops - stepFlops);
+        }
+        if (split) {
+            const int condRuns = stats.condCache ? 1 : std::max(1, field.evals);
+            stats.flopsSaved -= (float)condRuns * split->cond.flops + (float)split->tableMisses * split->time.flops;
+            stats.tableHits = split->tableHits;
+            stats.tableMisses = split->tableMisses;
+        }
+        stats.flowMs = elapsedMs(t_flow_start);
+        // Flow 调用被中途停下时积分器直接返回，不经过 onStep；以 RunGuard 的结果为准，Decoder 不再运行
+        cancelled = cancelled || guard.reason != RunGuard::None;
+
+        if (cancelled) {
+            // 在步边界停下时已完成的步仍记入轨迹缓存，同一图的后续请求从这里继续；
+            // 有 Flow 调用被中途打断时最后一步的速度不完整，不能缓存
+            if (resumable && stats.executedSteps > start_step && guard.aborts == 0) {
+                std::vector<float> latent(size);
+                field.exportCaffe(x, latent.data());
+                saveTrajectory(key, stats.executedSteps, latent.data(), hostL->host<float>(), size);
+            }
+            return abortRun("Flow");
+        }
+
+        // --- STEP 3: DECODER ---
+        // 原生排布的 latent 只在 Decoder 边界转换一次
+        auto t_dec_start = std::chrono::high_resolution_clock::now();
+        auto dIn = netDec->getSessionInput(sessDec, "input");
+        std::unique_ptr<Tensor> hDecIn(new Tensor(dIn, Tensor::CAFFE));
+        field.exportCaffe(x, hDecIn->host<float>());
+        dIn->copyFromHostTensor(hDecIn.get());
+
+        if (resumable && stats.executedSteps == solver_steps) {
+            // 提前结束 (earlyStop) 的结果不缓存：同样的请求续算剩余步会得到与本次不同的图
+            saveTrajectory(key, stats.executedSteps, hDecIn->host<float>(), hostL->host<float>(), size);
+        }
+
+        // 图内打包：Decoder 与 RGBA 打包一次 runSession 完成，逐元素运算走 MNN 线程池
+        SubNet* render = opts.graphRender ? getDecoderRender() : nullptr;
+        if (render) {
+            setSessionInput(render->net.get(), render->sess, "input", hDecIn->host<float>());
+            if (!runChecked(render->net.get(), render->sess)) {
+                return abortRun("Decoder");
+            }
+            auto rOut = render->net->getSessionOutput(render->sess, "rgba");
+            std::unique_ptr<Tensor> hRgba(new Tensor(rOut, Tensor::CAFFE));
+            rOut->copyToHostTensor(hRgba.get());
+            memcpy(output, hRgba->host<uint8_t>(), hRgba->size());
+            stats.graphRender = true;
         } else {
-            WriteLog("❌ Failed to load Decoder.mnn");
+            if (!runChecked(netDec.get(), sessDec)) {
+                return abortRun("Decoder");
+            }
+            auto dOut = netDec->getSessionOutput(sessDec, "output");
+
+            // --- STEP 4: OUTPUT RENDER ---
+            std::unique_ptr<Tensor> hFinal(new Tensor(dOut, Tensor::CAFFE));
+            dOut->copyToHostTensor(hFinal.get());
+            renderRGBA(hFinal->host<float>(), output);
         }
 
-        WriteLog(">>> CPU Engine Ready (FP16, 4 Threads) <<<");
+        stats.decMs = elapsedMs(t_dec_start);
+        stats.totalMs = elapsedMs(t_all_start);
+        lastStats = stats;
+        WriteLog("Success: %s", stats.summary().c_str());
+
+        return true;
     }
 
-    bool run(JNIEnv* env, jobject inBmp, jobject outBmp, int style, int steps) {
-        if (!sessEnc || !sessFlow || !sessDec) {
-            WriteLog("❌ Sessions not ready");
-            return false;
+    // 粗到细调度的质量 / 延迟：以全分辨率结果为参考，逐个 split 点 (前 k 步粗分辨率) 报告 PSNR 与耗时
+    // 每次运行前清空轨迹缓存，保证都从头计算；dst 最终保留最后一次的结果
+    std::string benchmarkCoarseToFine(JNIEnv* env, jobject src, jobject dst, int style, int steps) {
+        RunOptions opts;
+        opts.style = style;
+        opts.steps = std::max(1, std::min(steps, 50));
+        std::string report = "coarse-to-fine (steps=" + std::to_string(opts.steps) + "):";
+        std::vector<uint8_t> reference;
+        for (int k = 0; k <= opts.steps; k++) {
+            opts.coarseSteps = k;
+            trajectories.clear();
+            auto t0 = std::chrono::high_resolution_clock::now();
+            if (!run(env, src, dst, opts)) {
+                return report + " failed";
+            }
+            float ms = elapsedMs(t0);
+            void* pixels = nullptr;
+            AndroidBitmap_lockPixels(env, dst, &pixels);
+            const uint8_t* rgba = (const uint8_t*)pixels;
+            char buf[64];
+            if (k == 0) {
+                reference.assign(rgba, rgba + 512 * 512 * 4);
+                snprintf(buf, sizeof(buf), " k=0:ref/%.0fms", ms);
+            } else {
+                double se = 0.0;
+                for (int i = 0; i < 512 * 512 * 4; i++) {
+                    if ((i & 3) == 3) continue; // 跳过 Alpha
+                    double d = (double)rgba[i] - reference[i];
+                    se += d * d;
+                }
+                double mse = se / (512.0 * 512.0 * 3.0);
+                double psnr = mse > 0.0 ? 10.0 * std::log10(255.0 * 255.0 / mse) : 99.0;
+                snprintf(buf, sizeof(buf), " k=%d:%.1fdB/%.0fms", k, psnr, ms);
+            }
+            AndroidBitmap_unlockPixels(env, dst);
+            report += buf;
         }
+        WriteLog("%s", report.c_str());
+        return report;
+    }
 
-        auto t_all_start = std::chrono::high_resolution_clock::now();
+    // 整图流水线与三会话路径对比：端到端延迟 (各先预热一次，取 iters 次平均)、峰值内存与两者输出的 PSNR
+    // 三会话路径的内存为默认选项下实际用到的各 Session 之和 (含切分子网与图内打包)
+    std::string benchmarkWholeGraph(JNIEnv* env, jobject src, jobject dst, int style, int steps, int iters) {
+        RunOptions opts;
+        opts.style = style;
+        opts.steps = std::max(1, std::min(steps, 50));
+        iters = std::max(1, iters);
+        auto timed = [&]() -> float {
+            trajectories.clear();
+            if (!run(env, src, dst, opts)) return -1.0f; // 预热：建图 / 首次分配
+            float total = 0;
+            for (int i = 0; i < iters; i++) {
+                trajectories.clear();
+                auto t0 = std::chrono::high_resolution_clock::now();
+                run(env, src, dst, opts);
+                total += elapsedMs(t0);
+            }
+            return total / iters;
+        };
+        auto snapshot = [&](std::vector<uint8_t>& out) {
+            void* pixels = nullptr;
+            AndroidBitmap_lockPixels(env, dst, &pixels);
+            out.assign((const uint8_t*)pixels, (const uint8_t*)pixels + 512 * 512 * 4);
+            AndroidBitmap_unlockPixels(env, dst);
+        };
 
-        // --- STEP 1: ENCODER ---
-        auto tEncIn = netEnc->getSessionInput(sessEnc, "input");
+        float sessionMs = timed();
+        std::vector<uint8_t> reference, composed;
+        snapshot(reference);
+        float sessionMB = sessionMemoryMB(netEnc.get(), sessEnc) + sessionMemoryMB(netFlow.get(), sessFlow) +
+                          sessionMemoryMB(netDec.get(), sessDec) + sessionMemoryMB(decRender.net.get(), decRender.sess);
+        if (flowSplit) {
+            for (SubNet* sn : {&flowSplit->cond, &flowSplit->time, &flowSplit->loop}) {
+                sessionMB += sessionMemoryMB(sn->net.get(), sn->sess);
+            }
+        }
 
-        // 锁定位图处理
-        void* pixels;
-        AndroidBitmap_lockPixels(env, inBmp, &pixels);
-        if (!imgProc) {
-            CV::ImageProcess::Config c;
-            c.sourceFormat = CV::RGBA; c.destFormat = CV::RGB;
-            // mean=[127.5, ...], normal=[1/127.5, ...]
-            float m[3]={127.5f, 127.5f, 127.5f};
-            float n[3]={0.007843f, 0.007843f, 0.007843f};
-            memcpy(c.mean, m, sizeof(m));
-            memcpy(c.normal, n, sizeof(n));
-            imgProc.reset(CV::ImageProcess::create(c));
-        }
-        imgProc->convert((const uint8_t*)pixels, 512, 512, 0, tEncIn);
-        AndroidBitmap_unlockPixels(env, inBmp);
+        opts.wholeGraph = true;
+        float graphMs = timed();
+        if (graphMs < 0.0f || !lastStats.wholeGraph) {
+            return "whole-graph pipeline unavailable";
+        }
+        snapshot(composed);
+        float graphMB = 0;
+        pipeline.rtmgr->getInfo(Interpreter::MEMORY, &graphMB);
 
-        netEnc->runSession(sessEnc);
-        auto tEncOut = netEnc->getSessionOutput(sessEnc, "output");
+        double se = 0.0;
+        for (int i = 0; i < 512 * 512 * 4; i++) {
+            if ((i & 3) == 3) continue; // 跳过 Alpha
+            double d = (double)composed[i] - reference[i];
+            se += d * d;
+        }
+        double mse = se / (512.0 * 512.0 * 3.0);
+        double psnr = mse > 0.0 ? 10.0 * std::log10(255.0 * 255.0 / mse) : 99.0;
 
-        // --- STEP 2: FLOW LOOP ---
-        // 准备 Latent
-        int size = 1 * 4 * 64 * 64; // shape: [1, 4, 64, 64]
-        std::vector<float> latents(size);
+        char buf[192];
+        snprintf(buf, sizeof(buf), "whole-graph (steps=%d): sessions=%.1fms/%.1fMB composed=%.1fms/%.1fMB psnr=%.1fdB",
+                 opts.steps, sessionMs, sessionMB, graphMs, graphMB, psnr);
+        WriteLog("%s", buf);
+        return buf;
+    }
 
-        // Copy Encoder Output -> CPU -> Latents
-        std::unique_ptr<Tensor> hostL(new Tensor(tEncOut, Tensor::CAFFE));
-        tEncOut->copyToHostTensor(hostL.get());
-        memcpy(latents.data(), hostL->host<float>(), size * sizeof(float));
+    // 取消延迟：先完整跑一次得到总耗时 T，第 i 次在 (i + 0.5) / iters · T 时由另一线程置位取消标志，
+    // 记录置位到 runPixels 返回的时间；算子级检查与只在步边界检查各跑 iters 次。
+    // 最后以 T / 2 的时间预算跑一次，报告超出预算的时间；每次之后再完整跑一次确认 Session 仍可用
+    std::string benchmarkCancelLatency(const uint8_t* pixels, int style, int steps, int iters) {
+        iters = std::max(1, iters);
+        RunOptions opts;
+        opts.style = style;
+        opts.steps = steps;
+        std::vector<uint8_t> out(512 * 512 * 4), ref(out.size());
+        trajectories.clear();
+        auto t0 = std::chrono::steady_clock::now();
+        if (!runPixels(pixels, ref.data(), opts)) return "run failed";
+        const float fullMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - t0).count();
 
-        auto fXt = netFlow->getSessionInput(sessFlow, "x_t");
-        auto fXc = netFlow->getSessionInput(sessFlow, "x_cond");
-        auto fT = netFlow->getSessionInput(sessFlow, "t");
-        auto fS = netFlow->getSessionInput(sessFlow, "s");
-        auto fOut = netFlow->getSessionOutput(sessFlow, "output");
+        char buf[160];
+        std::string report;
+        snprintf(buf, sizeof(buf), "cancel latency (full=%.0fms):", fullMs);
+        report += buf;
+        for (bool opLevel : {true, false}) {
+            float sum = 0, worst = 0;
+            int hits = 0;
+            for (int i = 0; i < iters; i++) {
+                trajectories.clear();
+                std::atomic<bool> flag{false};
+                std::chrono::steady_clock::time_point setAt;
+                RunOptions o = opts;
+                o.cancelFlag = &flag;
+                o.opCancel = opLevel;
+                std::thread killer([&] {
+                    std::this_thread::sleep_for(std::chrono::microseconds((long long)((i + 0.5f) / iters * fullMs * 1000.0f)));
+                    setAt = std::chrono::steady_clock::now();
+                    flag = true;
+                });
+                bool finished = runPixels(pixels, out.data(), o);
+                auto returned = std::chrono::steady_clock::now();
+                killer.join();
+                if (!finished) {
+                    float ms = std::chrono::duration<float, std::milli>(returned - setAt).count();
+                    sum += ms;
+                    worst = std::max(worst, ms);
+                    hits++;
+                }
+            }
+            snprintf(buf, sizeof(buf), " %s=avg %.1fms/max %.1fms (%d/%d aborted)", opLevel ? "op" : "step",
+                     hits ? sum / hits : 0.0f, worst, hits, iters);
+            report += buf;
+        }
 
-        // 设置 Condition (Encoder output)
-        fXc->copyFromHostTensor(hostL.get());
+        trajectories.clear();
+        RunOptions o = opts;
+        o.deadlineMs = fullMs * 0.5f;
+        t0 = std::chrono::steady_clock::now();
+        bool finished = runPixels(pixels, out.data(), o);
+        float ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        trajectories.clear();
+        bool reusable = runPixels(pixels, out.data(), opts) && out == ref;
+        snprintf(buf, sizeof(buf), " deadline=%.0fms:%s overshoot=%.1fms reusable=%d", o.deadlineMs,
+                 finished ? "finished" : lastStats.deadlineExceeded ? "timed_out" : "failed", ms - o.deadlineMs,
+                 reusable ? 1 : 0);
+        report += buf;
+        WriteLog("%s", report.c_str());
+        return report;
+    }
 
-        // 设置 Style ID
-        std::unique_ptr<Tensor> hS(new Tensor(fS, Tensor::CAFFE));
-        hS->host<int>()[0] = style;
-        fS->copyFromHostTensor(hS.get());
+    // 微基准：Flow 单步的 Host 侧开销（不含 runSession），对比旧路径与融合路径
+    // 旧路径：memcpy -> copyFromHostTensor -> copyToHostTensor -> 标量 x += v * dt
+    // 新路径：直接在 Session 内存上做一次 SIMD 融合更新（不可直接访问时退化为拷贝 + SIMD）
+    std::string benchmarkStepOverhead(int iters) {
+        ensureDefaultSessions();
+        if (!sessFlow) return "sessions not ready";
+        iters = std::max(1, iters);
+        const int size = 1 * 4 * 64 * 64;
+        const float fixed_dt = 0.05f;
+        auto fXt = netFlow->getSessionInput(sessFlow, "x_t");
+        auto fOut = netFlow->getSessionOutput(sessFlow, "output");
 
-        // 预分配 Buffer
         std::unique_ptr<Tensor> hXt(new Tensor(fXt, Tensor::CAFFE));
-        std::unique_ptr<Tensor> hT(new Tensor(fT, Tensor::CAFFE));
         std::unique_ptr<Tensor> hV(new Tensor(fOut, Tensor::CAFFE));
-
-        // 动态步数控制 (限制在 1~50 之间防止死机)
-        int safe_steps = std::max(1, std::min(steps, 50));
-        float dt = 1.0f / (float)safe_steps * 0.2f; // 简单缩放时间步长，保持总流形长度大致一致（可选逻辑）
-        // 或者保持固定步长 dt=0.05，此时 steps 越多效果越强/变化越大
-        // 这里采用原逻辑：步长固定 0.05
-        float fixed_dt = 0.05f;
-
-        for (int i = 0; i < safe_steps; i++) {
-            // 输入当前的 latents
+        std::vector<float> latents(size, 0.1f);
+        auto t0 = std::chrono::high_resolution_clock::now();
+        for (int it = 0; it < iters; it++) {
             memcpy(hXt->host<float>(), latents.data(), size * sizeof(float));
             fXt->copyFromHostTensor(hXt.get());
-
-            // 输入时间 t
-            hT->host<float>()[0] = (float)i * fixed_dt;
-            fT->copyFromHostTensor(hT.get());
-
-            // 推理
-            netFlow->runSession(sessFlow);
-
-            // 获取速度场 v
             fOut->copyToHostTensor(hV.get());
             float* v = hV->host<float>();
-
-            // Euler 积分更新: x = x + v * dt
             for (int j = 0; j < size; j++) {
                 latents[j] += v[j] * fixed_dt;
             }
         }
+        float legacyUs = elapsedMs(t0) * 1000.0f / iters;
 
-        // --- STEP 3: DECODER ---
-        auto dIn = netDec->getSessionInput(sessDec, "input");
-        std::unique_ptr<Tensor> hDecIn(new Tensor(dIn, Tensor::CAFFE));
-        memcpy(hDecIn->host<float>(), latents.data(), size * sizeof(float));
-        dIn->copyFromHostTensor(hDecIn.get());
+        FlowField field(netFlow.get(), sessFlow, size);
+        float* x = field.directInput() ? field.directInput() : latents.data();
+        const float* v = field.eval(x, 0.0f); // 一次真实调用以完成 output 探测
+        t0 = std::chrono::high_resolution_clock::now();
+        for (int it = 0; it < iters; it++) {
+            if (!field.direct()) {
+                memcpy(hXt->host<float>(), x, size * sizeof(float));
+                fXt->copyFromHostTensor(hXt.get());
+                fOut->copyToHostTensor(hV.get());
+                v = hV->host<float>();
+            }
+            axpy(x, x, fixed_dt, v, size);
+        }
+        float fusedUs = elapsedMs(t0) * 1000.0f / iters;
 
-        netDec->runSession(sessDec);
-        auto dOut = netDec->getSessionOutput(sessDec, "output");
+        char buf[160];
+        snprintf(buf, sizeof(buf), "step host overhead: legacy=%.1fus fused=%.1fus direct=%d iters=%d",
+                 legacyUs, fusedUs, field.direct() ? 1 : 0, iters);
+        WriteLog("%s", buf);
+        return buf;
+    }
+};
 
-        // --- STEP 4: OUTPUT RENDER ---
-        AndroidBitmap_lockPixels(env, outBmp, &pixels);
-        std::unique_ptr<Tensor> hFinal(new Tensor(dOut, Tensor::CAFFE));
-        dOut->copyToHostTensor(hFinal.get());
+// 全局引擎指针；JNI 入口与调度线程都在 g_engineMutex 下访问
+static SAFlowEngine* g_engine = nullptr;
+static std::mutex g_engineMutex;
+
+// 动态批处理调度：并发请求先入队，兼容的请求 (步数与积分参数相同) 合并成一次 batch 推理，
+// 凑满 maxBatch 或队首等待超过 maxWait 即提交，结果按请求拆回
+class BatchScheduler {
+public:
+    struct Request {
+        std::vector<uint8_t> input;  // 512x512 RGBA
+        std::vector<uint8_t> output;
+        RunOptions opts;
+        std::chrono::high_resolution_clock::time_point enqueued;
+        RunStats stats;
+        bool done = false, ok = false;
+    };
 
-        float* data = hFinal->host<float>();
-        uint8_t* rgba = (uint8_t*)pixels;
-        int total_pixels = 512 * 512;
+    ~BatchScheduler() {
+        {
+            std::lock_guard<std::mutex> lk(mMutex);
+            mStop = true;
+        }
+        mCv.notify_all();
+        if (mWorker.joinable()) mWorker.join();
+    }
 
-        // 简单的反归一化与排布
-        for (int i = 0; i < total_pixels; i++) {
-            // Channel 0, 1, 2 分别偏移 0, 262144, 524288
-            float r = data[i];
-            float g = data[i + total_pixels];
-            float b = data[i + total_pixels * 2];
+    void configure(int maxBatch, float maxWaitMs) {
+        std::lock_guard<std::mutex> lk(mMutex);
+        mMaxBatch = std::max(1, std::min(maxBatch, 8));
+        mMaxWaitMs = std::max(0.0f, maxWaitMs);
+        mCv.notify_all();
+    }
 
-            rgba[i*4+0] = (uint8_t)std::clamp(r * 255.0f, 0.0f, 255.0f);
-            rgba[i*4+1] = (uint8_t)std::clamp(g * 255.0f, 0.0f, 255.0f);
-            rgba[i*4+2] = (uint8_t)std::clamp(b * 255.0f, 0.0f, 255.0f);
-            rgba[i*4+3] = 255; // Alpha
+    // 阻塞直到请求完成
+    bool submit(Request& req) {
+        std::unique_lock<std::mutex> lk(mMutex);
+        if (!mWorker.joinable()) {
+            mWorker = std::thread(&BatchScheduler::loop, this);
         }
-        AndroidBitmap_unlockPixels(env, outBmp);
+        req.output.resize(req.input.size());
+        req.enqueued = std::chrono::high_resolution_clock::now();
+        mQueue.push_back(&req);
+        mMaxDepth = std::max(mMaxDepth, (int)mQueue.size());
+        mCv.notify_all();
+        mDone.wait(lk, [&] { return req.done; });
+        return req.ok;
+    }
+
+    std::string stats() {
+        std::lock_guard<std::mutex> lk(mMutex);
+        long batches = 0;
+        for (long c : mBatchHist) batches += c;
+        char buf[320];
+        int n = snprintf(buf, sizeof(buf), "queue_depth=%d max_depth=%d requests=%ld batches=%ld avg_batch=%.2f hist=[",
+                         (int)mQueue.size(), mMaxDepth, mRequests, batches, batches ? (float)mRequests / batches : 0.0f);
+        for (size_t i = 1; i < mBatchHist.size(); i++) {
+            n += snprintf(buf + n, sizeof(buf) - n, "%s%d:%ld", i > 1 ? " " : "", (int)i, mBatchHist[i]);
+        }
+        snprintf(buf + n, sizeof(buf) - n, "] queue_delay avg=%.1fms max=%.1fms max_wait=%.1fms",
+                 mRequests ? (float)(mQueueMsSum / mRequests) : 0.0f, mQueueMsMax, mMaxWaitMs);
+        return buf;
+    }
+
+private:
+    // runBatch 只实现固定参数的 Flow 循环；CFG、风格特化 / Express / 展开 / 整图、精度与分辨率调度、
+    // 取消与时间预算都只有单图路径支持，带这些选项的请求单独走 runPixels
+    static bool batchable(const RunOptions& o) {
+        return o.guidance <= 0.0f && !o.styleGraph && !o.expressStep && o.unroll <= 1 && !o.wholeGraph &&
+               o.fp32Steps <= 0 && o.coarseSteps <= 0 && o.deadlineMs <= 0.0f && !o.cancelFlag && !o.onStep;
+    }
+
+    // 能合并进同一 batch 的请求：Flow 循环的步数与积分参数完全相同，风格可以不同
+    static bool compatible(const RunOptions& a, const RunOptions& b) {
+        return batchable(a) && batchable(b) && a.steps == b.steps && a.solver == b.solver && a.solverSteps == b.solverSteps &&
+               a.tolerance == b.tolerance && a.earlyStop == b.earlyStop && a.earlyStopMaxNorm == b.earlyStopMaxNorm &&
+               a.reuseDrift == b.reuseDrift && a.maxReuse == b.maxReuse && a.nativeLayout == b.nativeLayout;
+    }
 
-        auto t_all_end = std::chrono::high_resolution_clock::now();
-        float cost = std::chrono::duration<float, std::milli>(t_all_end - t_all_start).count();
-        WriteLog("Success: steps=%d, cost=%.2f ms", safe_steps, cost);
+    int countCompatible() const {
+        int n = 0;
+        for (Request* r : mQueue) {
+            n += compatible(r->opts, mQueue.front()->opts) ? 1 : 0;
+        }
+        return n;
+    }
+
+    void loop() {
+        std::unique_lock<std::mutex> lk(mMutex);
+        while (true) {
+            mCv.wait(lk, [&] { return mStop || !mQueue.empty(); });
+            if (mStop) break;
+            auto deadline = mQueue.front()->enqueued +
+                            std::chrono::microseconds((long long)(mMaxWaitMs * 1000.0f));
+            mCv.wait_until(lk, deadline, [&] {
+                return mStop || !batchable(mQueue.front()->opts) || countCompatible() >= mMaxBatch;
+            });
+            if (mStop) break;
+
+            // 取出与队首兼容的请求 (保持先来先服务)；队首不能合并时单独处理
+            const RunOptions head = mQueue.front()->opts;
+            std::vector<Request*> batch = {mQueue.front()};
+            mQueue.pop_front();
+            for (auto it = mQueue.begin(); it != mQueue.end() && (int)batch.size() < mMaxBatch;) {
+                if (compatible((*it)->opts, head)) {
+                    batch.push_back(*it);
+                    it = mQueue.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            auto started = std::chrono::high_resolution_clock::now();
+            lk.unlock();
+
+            std::vector<const uint8_t*> ins;
+            std::vector<uint8_t*> outs;
+            std::vector<int> styles;
+            for (Request* r : batch) {
+                ins.push_back(r->input.data());
+                outs.push_back(r->output.data());
+                styles.push_back(r->opts.style);
+            }
+            RunStats stats;
+            bool ok = false;
+            std::vector<char> oks(batch.size(), 0);
+            {
+                std::lock_guard<std::mutex> engineLock(g_engineMutex);
+                if (g_engine && (batch.size() == 1 || g_engine->customFlow())) {
+                    // 单个请求或批量路径不支持的 Flow 模型：逐个走单图路径
+                    for (size_t i = 0; i < batch.size(); i++) {
+                        oks[i] = g_engine->runPixels(ins[i], outs[i], batch[i]->opts);
+                        ok = ok || oks[i];
+                    }
+                    stats = g_engine->lastStats;
+                } else if (g_engine) {
+                    ok = g_engine->runBatch(ins, outs, styles, batch[0]->opts, stats);
+                    std::fill(oks.begin(), oks.end(), ok);
+                    if (ok) {
+                        g_engine->lastStats = stats;
+                    }
+                }
+            }
+
+            lk.lock();
+            if ((int)mBatchHist.size() <= (int)batch.size()) {
+                mBatchHist.resize(batch.size() + 1, 0);
+            }
+            mBatchHist[batch.size()]++;
+            for (size_t i = 0; i < batch.size(); i++) {
+                Request* r = batch[i];
+                float queued = std::chrono::duration<float, std::milli>(started - r->enqueued).count();
+                mRequests++;
+                mQueueMsSum += queued;
+                mQueueMsMax = std::max(mQueueMsMax, queued);
+                r->stats = stats;
+                r->stats.queueMs = queued;
+                r->ok = oks[i];
+                r->done = true;
+            }
+            WriteLog("Scheduler batch %d: %s", (int)batch.size(), ok ? stats.summary().c_str() : "failed");
+            mDone.notify_all();
+        }
+        // 退出时未处理的请求直接失败返回
+        for (Request* r : mQueue) {
+            r->done = true;
+        }
+        mQueue.clear();
+        mDone.notify_all();
+    }
+
+    std::mutex mMutex;
+    std::condition_variable mCv, mDone;
+    std::deque<Request*> mQueue;
+    std::thread mWorker;
+    bool mStop = false;
+    int mMaxBatch = 4;
+    float mMaxWaitMs = 20.0f;
+
+    // 统计
+    std::vector<long> mBatchHist;   // 下标为 batch 大小
+    long mRequests = 0;
+    double mQueueMsSum = 0;
+    float mQueueMsMax = 0;
+    int mMaxDepth = 0;
+};
+
+static BatchScheduler g_scheduler;
+
+// 异步任务：submit 拷贝输入后立即返回任务 id，后台线程按提交顺序逐个执行；
+// cancel 在下一个算子边界生效 (Express 路径为下一个 Flow 步边界)；进度回调由单独的通知线程 (已 attach 到 JVM)
+// 在引擎锁之外调用，监听器里可以调用任何引擎接口；未送达的连续进度会合并，只送达最新一次
+class JobManager {
+public:
+    // 需与 Kotlin 侧 JobState 保持一致
+    enum State { Queued = 0, Running = 1, Done = 2, Failed = 3, Cancelled = 4, TimedOut = 5, Expired = 6 };
+
+    struct Job {
+        int id = 0;
+        std::vector<uint8_t> input, output; // 512x512 RGBA
+        RunOptions opts;
+        jobject listener = nullptr;         // 全局引用，任务结束后由通知线程释放
+        jmethodID onProgress = nullptr;
+        bool progressQueued = false;        // 已在通知队列中等待送达
+        std::atomic<bool> cancel{false};
+        State state = Queued;
+        int step = 0, total = 0;
+        float elapsedMs = 0;
+    };
+
+    ~JobManager() {
+        {
+            std::lock_guard<std::mutex> lk(mMutex);
+            mStop = true;
+        }
+        mCv.notify_all();
+        if (mWorker.joinable()) mWorker.join();
+        // 后台线程退出后不再有新通知，通知线程处理完剩余的监听器释放再退出
+        {
+            std::lock_guard<std::mutex> lk(mMutex);
+            mNotifyStop = true;
+        }
+        mNotifyCv.notify_all();
+        if (mNotifier.joinable()) mNotifier.join();
+    }
+
+    // supersede 为 true 时取消此前所有未结束的任务 (如滑块拖动后旧参数的结果已无用)
+    int submit(JNIEnv* env, std::vector<uint8_t> input, const RunOptions& opts, jobject listener, bool supersede) {
+        std::lock_guard<std::mutex> lk(mMutex);
+        if (!mVm) {
+            env->GetJavaVM(&mVm);
+        }
+        if (!mWorker.joinable()) {
+            mWorker = std::thread(&JobManager::loop, this);
+            mNotifier = std::thread(&JobManager::notifyLoop, this);
+        }
+        if (supersede) {
+            for (auto& kv : mJobs) {
+                if (kv.second->state == Queued || kv.second->state == Running) {
+                    kv.second->cancel = true;
+                }
+            }
+        }
+        auto job = std::make_shared<Job>();
+        job->id = ++mNextId;
+        job->input = std::move(input);
+        job->output.resize(job->input.size());
+        job->opts = opts;
+        job->listener = listener ? env->NewGlobalRef(listener) : nullptr;
+        if (job->listener) {
+            jclass cls = env->GetObjectClass(job->listener);
+            job->onProgress = env->GetMethodID(cls, "onProgress", "(IIIF)V");
+            if (env->ExceptionCheck()) env->ExceptionClear();
+            env->DeleteLocalRef(cls);
+        }
+        mJobs[job->id] = job;
+        mQueue.push_back(job);
+        evictFinished();
+        mCv.notify_all();
+        return job->id;
+    }
 
+    bool cancel(int id) {
+        std::lock_guard<std::mutex> lk(mMutex);
+        auto it = mJobs.find(id);
+        if (it == mJobs.end() || (it->second->state != Queued && it->second->state != Running)) return false;
+        it->second->cancel = true;
         return true;
     }
+
+    // out: 状态、已完成步数、总步数、已耗时 (ms)；任务不存在时返回 false
+    bool poll(int id, jint out[4]) {
+        std::lock_guard<std::mutex> lk(mMutex);
+        auto it = mJobs.find(id);
+        if (it == mJobs.end()) return false;
+        const Job& job = *it->second;
+        out[0] = job.state;
+        out[1] = job.step;
+        out[2] = job.total;
+        out[3] = (jint)job.elapsedMs;
+        return true;
+    }
+
+    // 取走已完成任务的结果，之后该任务不再保留；结果已过期 (EXPIRED) 或任务不存在时返回 false
+    bool fetch(int id, uint8_t* dst) {
+        std::lock_guard<std::mutex> lk(mMutex);
+        auto it = mJobs.find(id);
+        if (it == mJobs.end() || it->second->state != Done) return false;
+        memcpy(dst, it->second->output.data(), it->second->output.size());
+        mJobs.erase(it);
+        return true;
+    }
+
+private:
+    static constexpr int kMaxFinished = 8;  // 失败 / 取消 / 超时 / 过期的任务最多保留数 (供 poll 查询状态)
+    static constexpr int kMaxUnfetched = 4; // 未取走的 Done 结果最多保留数 (每个 512x512 RGBA 1 MiB)
+
+    // 未取走的 Done 结果超出上限时，最旧的释放结果并标记为 Expired (poll 报告 EXPIRED，fetch 返回 false)；
+    // 没有结果的结束任务超出上限时，最旧的整个删除 (poll 报告 UNKNOWN)
+    void evictFinished() {
+        int unfetched = 0;
+        for (auto it = mJobs.rbegin(); it != mJobs.rend(); ++it) {
+            Job& job = *it->second;
+            if (job.state == Done && ++unfetched > kMaxUnfetched) {
+                job.state = Expired;
+                job.output.clear();
+                job.output.shrink_to_fit();
+                WriteLog("Job %d result expired before it was fetched", job.id);
+            }
+        }
+        int finished = 0;
+        for (auto it = mJobs.rbegin(); it != mJobs.rend(); ++it) {
+            finished += it->second->state > Done ? 1 : 0;
+        }
+        for (auto it = mJobs.begin(); it != mJobs.end() && finished > kMaxFinished;) {
+            if (it->second->state > Done) {
+                it = mJobs.erase(it);
+                finished--;
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void loop() {
+        JNIEnv* env = nullptr;
+        mVm->AttachCurrentThread(&env, nullptr);
+        std::unique_lock<std::mutex> lk(mMutex);
+        while (true) {
+            mCv.wait(lk, [&] { return mStop || !mQueue.empty(); });
+            if (mStop) break;
+            std::shared_ptr<Job> job = mQueue.front();
+            mQueue.pop_front();
+            if (!job->cancel) {
+                job->state = Running;
+                lk.unlock();
+                run(job);
+                lk.lock();
+                // 监听器交给通知线程：排在该任务尚未送达的进度之后释放
+                if (job->listener) {
+                    mNotify.emplace_back(job, true);
+                    mNotifyCv.notify_all();
+                }
+            } else {
+                job->state = Cancelled;
+                if (job->listener) {
+                    env->DeleteGlobalRef(job->listener);
+                    job->listener = nullptr;
+                }
+            }
+            job->input.clear();
+            job->input.shrink_to_fit();
+        }
+        mQueue.clear();
+        lk.unlock();
+        mVm->DetachCurrentThread();
+    }
+
+    // 通知线程：按队列顺序送达进度 (取送达时刻的最新值)，并释放已结束任务的监听器
+    void notifyLoop() {
+        JNIEnv* env = nullptr;
+        mVm->AttachCurrentThread(&env, nullptr);
+        std::unique_lock<std::mutex> lk(mMutex);
+        while (true) {
+            mNotifyCv.wait(lk, [&] { return mNotifyStop || !mNotify.empty(); });
+            if (mNotify.empty()) break;
+            std::shared_ptr<Job> job = mNotify.front().first;
+            const bool release = mNotify.front().second;
+            mNotify.pop_front();
+            if (release) {
+                env->DeleteGlobalRef(job->listener);
+                job->listener = nullptr;
+                continue;
+            }
+            job->progressQueued = false;
+            if (!job->onProgress) continue;
+            const int step = job->step, total = job->total;
+            const float ms = job->elapsedMs;
+            lk.unlock();
+            env->CallVoidMethod(job->listener, job->onProgress, (jint)job->id, (jint)step, (jint)total, (jfloat)ms);
+            if (env->ExceptionCheck()) env->ExceptionClear();
+            lk.lock();
+        }
+        lk.unlock();
+        mVm->DetachCurrentThread();
+    }
+
+    void run(const std::shared_ptr<Job>& handle) {
+        Job& job = *handle;
+        auto start = std::chrono::high_resolution_clock::now();
+        RunOptions opts = job.opts;
+        opts.cancelFlag = &job.cancel;
+        // 运行期间持有引擎锁：这里只记录进度并排队，由通知线程在锁外回调 Java
+        opts.onStep = [&](int step, int total) {
+            float ms = elapsedMs(start);
+            std::lock_guard<std::mutex> lk(mMutex);
+            job.step = step;
+            job.total = total;
+            job.elapsedMs = ms;
+            if (job.listener && !job.progressQueued) {
+                job.progressQueued = true;
+                mNotify.emplace_back(handle, false);
+                mNotifyCv.notify_all();
+            }
+            return !job.cancel;
+        };
+        bool ok = false, timedOut = false;
+        {
+            std::lock_guard<std::mutex> engineLock(g_engineMutex);
+            // 排队等锁期间被取消的任务不再启动
+            if (g_engine && !job.cancel) {
+                ok = g_engine->runPixels(job.input.data(), job.output.data(), opts);
+                timedOut = !ok && g_engine->lastStats.deadlineExceeded;
+            }
+        }
+        std::lock_guard<std::mutex> lk(mMutex);
+        job.state = ok ? Done : timedOut ? TimedOut : job.cancel ? Cancelled : Failed;
+        job.elapsedMs = elapsedMs(start);
+        static const char* kStateNames[] = {"queued", "running", "done", "failed", "cancelled", "timed out", "expired"};
+        WriteLog("Job %d %s after %.1fms (step %d/%d)", job.id, kStateNames[job.state], job.elapsedMs, job.step, job.total);
+        evictFinished();
+    }
+
+    std::mutex mMutex;
+    std::condition_variable mCv;
+    std::deque<std::shared_ptr<Job>> mQueue;
+    std::map<int, std::shared_ptr<Job>> mJobs; // 按 id 排序，含未取走的已结束任务
+    std::deque<std::pair<std::shared_ptr<Job>, bool>> mNotify; // (任务, 是否为释放监听器)，由通知线程处理
+    std::condition_variable mNotifyCv;
+    std::thread mWorker, mNotifier;
+    JavaVM* mVm = nullptr;
+    bool mStop = false, mNotifyStop = false;
+    int mNextId = 0;
 };
 
-// 全局引擎指针
-static SAFlowEngine* g_engine = nullptr;
+static JobManager g_jobs;
 
 extern "C" JNIEXPORT jboolean JNICALL
 Java_com_example_mnn_MainActivity_initEngine(JNIEnv* env, jobject thiz, jstring jCacheDir) {
     const char* path = env->GetStringUTFChars(jCacheDir, nullptr);
+    std::lock_guard<std::mutex> lock(g_engineMutex);
     if (g_engine) {
         delete g_engine;
         g_engine = nullptr;
@@ -236,9 +3877,307 @@ Java_com_example_mnn_MainActivity_initEngine(JNIEnv* env, jobject thiz, jstring
     return JNI_TRUE;
 }
 
-// 注意：增加了 steps 参数
+// 读取 Kotlin 端的 FlowOptions
+static RunOptions readRunOptions(JNIEnv* env, jobject jOpts) {
+    RunOptions opts;
+    if (!jOpts) return opts;
+    jclass cls = env->GetObjectClass(jOpts);
+    opts.solver = (FlowSolver)env->GetIntField(jOpts, env->GetFieldID(cls, "solver", "I"));
+    opts.solverSteps = env->GetIntField(jOpts, env->GetFieldID(cls, "solverSteps", "I"));
+    opts.tolerance = env->GetFloatField(jOpts, env->GetFieldID(cls, "tolerance", "F"));
+    opts.earlyStop = env->GetFloatField(jOpts, env->GetFieldID(cls, "earlyStop", "F"));
+    opts.earlyStopMaxNorm = env->GetBooleanField(jOpts, env->GetFieldID(cls, "earlyStopMaxNorm", "Z"));
+    opts.reuseDrift = env->GetFloatField(jOpts, env->GetFieldID(cls, "reuseDrift", "F"));
+    opts.maxReuse = env->GetIntField(jOpts, env->GetFieldID(cls, "maxReuse", "I"));
+    opts.nativeLayout = env->GetBooleanField(jOpts, env->GetFieldID(cls, "nativeLayout", "Z"));
+    opts.expressStep = env->GetBooleanField(jOpts, env->GetFieldID(cls, "expressStep", "Z"));
+    opts.unroll = env->GetIntField(jOpts, env->GetFieldID(cls, "unroll", "I"));
+    opts.condCache = env->GetBooleanField(jOpts, env->GetFieldID(cls, "condCache", "Z"));
+    opts.styleGraph = env->GetBooleanField(jOpts, env->GetFieldID(cls, "styleGraph", "Z"));
+    opts.timeTable = env->GetBooleanField(jOpts, env->GetFieldID(cls, "timeTable", "Z"));
+    opts.guidance = env->GetFloatField(jOpts, env->GetFieldID(cls, "guidance", "F"));
+    opts.nullStyle = env->GetIntField(jOpts, env->GetFieldID(cls, "nullStyle", "I"));
+    opts.fp32Steps = env->GetIntField(jOpts, env->GetFieldID(cls, "fp32Steps", "I"));
+    opts.coarseSteps = env->GetIntField(jOpts, env->GetFieldID(cls, "coarseSteps", "I"));
+    opts.graphRender = env->GetBooleanField(jOpts, env->GetFieldID(cls, "graphRender", "Z"));
+    opts.wholeGraph = env->GetBooleanField(jOpts, env->GetFieldID(cls, "wholeGraph", "Z"));
+    opts.deadlineMs = env->GetFloatField(jOpts, env->GetFieldID(cls, "deadlineMs", "F"));
+    env->DeleteLocalRef(cls);
+    return opts;
+}
+
+// 注意：增加了 steps 与 options 参数
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_example_mnn_MainActivity_runStyleTransfer(JNIEnv* env, jobject thiz, jobject src, jobject dst, jint styleId, jint steps, jobject jOpts) {
+    std::lock_guard<std::mutex> lock(g_engineMutex);
+    if (!g_engine) return JNI_FALSE;
+    RunOptions opts = readRunOptions(env, jOpts);
+    opts.style = (int)styleId;
+    opts.steps = (int)steps;
+    return g_engine->run(env, src, dst, opts);
+}
+
+static std::vector<jobject> bitmapList(JNIEnv* env, jobjectArray arr) {
+    std::vector<jobject> list;
+    for (jsize i = 0; i < env->GetArrayLength(arr); i++) {
+        list.push_back(env->GetObjectArrayElement(arr, i));
+    }
+    return list;
+}
+
+static void releaseBitmapList(JNIEnv* env, const std::vector<jobject>& list) {
+    for (jobject o : list) {
+        env->DeleteLocalRef(o);
+    }
+}
+
+// 多风格对比：一张输入图，styleIds 与 dsts 一一对应
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_example_mnn_MainActivity_runStyleBatch(JNIEnv* env, jobject thiz, jobject src, jobjectArray dsts, jintArray styleIds, jint steps, jobject jOpts) {
+    std::lock_guard<std::mutex> lock(g_engineMutex);
+    if (!g_engine) return JNI_FALSE;
+    RunOptions opts = readRunOptions(env, jOpts);
+    opts.steps = (int)steps;
+    std::vector<int> styles(env->GetArrayLength(styleIds));
+    env->GetIntArrayRegion(styleIds, 0, (jsize)styles.size(), styles.data());
+    std::vector<jobject> outs = bitmapList(env, dsts);
+    bool ok = g_engine->runBatch(env, {src}, outs, styles, opts);
+    releaseBitmapList(env, outs);
+    return ok ? JNI_TRUE : JNI_FALSE;
+}
+
+// 批量多图：srcs 与 dsts 一一对应，统一使用 styleId
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_example_mnn_MainActivity_runImageBatch(JNIEnv* env, jobject thiz, jobjectArray srcs, jobjectArray dsts, jint styleId, jint steps, jobject jOpts) {
+    std::lock_guard<std::mutex> lock(g_engineMutex);
+    if (!g_engine) return JNI_FALSE;
+    RunOptions opts = readRunOptions(env, jOpts);
+    opts.style = (int)styleId;
+    opts.steps = (int)steps;
+    std::vector<jobject> ins = bitmapList(env, srcs);
+    std::vector<jobject> outs = bitmapList(env, dsts);
+    std::vector<int> styles(outs.size(), opts.style);
+    bool ok = !ins.empty() && ins.size() == outs.size() && g_engine->runBatch(env, ins, outs, styles, opts);
+    releaseBitmapList(env, ins);
+    releaseBitmapList(env, outs);
+    return ok ? JNI_TRUE : JNI_FALSE;
+}
+
+// 分阶段流水线批量推理：srcs[i] -> dsts[i]，三个阶段在各自的核组上同时处理不同的图
 extern "C" JNIEXPORT jboolean JNICALL
-Java_com_example_mnn_MainActivity_runStyleTransfer(JNIEnv* env, jobject thiz, jobject src, jobject dst, jint styleId, jint steps) {
+Java_com_example_mnn_MainActivity_runStylePipeline(JNIEnv* env, jobject thiz, jobjectArray srcs, jobjectArray dsts, jint styleId, jint steps, jobject jOpts) {
+    std::lock_guard<std::mutex> lock(g_engineMutex);
     if (!g_engine) return JNI_FALSE;
-    return g_engine->run(env, src, dst, (int)styleId, (int)steps);
+    RunOptions opts = readRunOptions(env, jOpts);
+    opts.style = (int)styleId;
+    opts.steps = (int)steps;
+    std::vector<jobject> ins = bitmapList(env, srcs);
+    std::vector<jobject> outs = bitmapList(env, dsts);
+    bool ok = g_engine->runStagePipeline(env, ins, outs, opts);
+    releaseBitmapList(env, ins);
+    releaseBitmapList(env, outs);
+    return ok ? JNI_TRUE : JNI_FALSE;
+}
+
+// 流水线各阶段的核组 (CPU 编号)，为空或 null 时自动分配
+extern "C" JNIEXPORT void JNICALL
+Java_com_example_mnn_MainActivity_configureStagePipeline(JNIEnv* env, jobject thiz, jintArray encCores, jintArray flowCores, jintArray decCores) {
+    std::vector<int> cores[3];
+    jintArray arrays[3] = {encCores, flowCores, decCores};
+    for (int k = 0; k < 3; k++) {
+        if (!arrays[k]) continue;
+        cores[k].resize(env->GetArrayLength(arrays[k]));
+        env->GetIntArrayRegion(arrays[k], 0, (jsize)cores[k].size(), cores[k].data());
+    }
+    std::lock_guard<std::mutex> lock(g_engineMutex);
+    if (g_engine) g_engine->configureStagePipeline(cores);
+}
+
+// 最近一次流水线运行的吞吐与各阶段利用率
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_example_mnn_MainActivity_getStagePipelineStats(JNIEnv* env, jobject thiz) {
+    std::lock_guard<std::mutex> lock(g_engineMutex);
+    return env->NewStringUTF(g_engine ? g_engine->lastPipelineReport.c_str() : "");
+}
+
+// 经会话池的单图推理：不持有引擎锁，多个调用可在不同槽位上同时运行
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_example_mnn_MainActivity_runStyleTransferPooled(JNIEnv* env, jobject thiz, jobject src, jobject dst, jint styleId, jint steps, jobject jOpts) {
+    RunOptions opts = readRunOptions(env, jOpts);
+    opts.style = (int)styleId;
+    opts.steps = (int)steps;
+    // 不支持的选项在建池之前拒绝，避免为一个被拒的请求释放引擎的默认 Session
+    if (const char* option = SessionPool::unsupportedOption(opts)) {
+        WriteLog("❌ Session pool: option '%s' is not supported on the pooled path, request rejected", option);
+        return JNI_FALSE;
+    }
+    std::shared_ptr<SessionPool> pool;
+    {
+        std::lock_guard<std::mutex> lock(g_engineMutex);
+        if (!g_engine) return JNI_FALSE;
+        pool = g_engine->getSessionPool();
+    }
+    if (!pool) return JNI_FALSE;
+    void* pixels = nullptr;
+    AndroidBitmap_lockPixels(env, src, &pixels);
+    std::vector<uint8_t> input((const uint8_t*)pixels, (const uint8_t*)pixels + 512 * 512 * 4);
+    AndroidBitmap_unlockPixels(env, src);
+    std::vector<uint8_t> output(input.size());
+    RunStats stats;
+    if (!pool->run(input.data(), output.data(), opts, stats)) return JNI_FALSE;
+    AndroidBitmap_lockPixels(env, dst, &pixels);
+    memcpy(pixels, output.data(), output.size());
+    AndroidBitmap_unlockPixels(env, dst);
+    return JNI_TRUE;
+}
+
+// 会话池大小：槽位数与每个槽位的线程数 (0 表示平分引擎线程数)，下次使用时重建
+extern "C" JNIEXPORT void JNICALL
+Java_com_example_mnn_MainActivity_configureSessionPool(JNIEnv* env, jobject thiz, jint slots, jint threadsPerSlot) {
+    std::lock_guard<std::mutex> lock(g_engineMutex);
+    if (g_engine) g_engine->configureSessionPool((int)slots, (int)threadsPerSlot);
+}
+
+// 会话池统计：槽位占用、运行次数、等待槽位的时间
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_example_mnn_MainActivity_getSessionPoolStats(JNIEnv* env, jobject thiz) {
+    std::lock_guard<std::mutex> lock(g_engineMutex);
+    auto pool = g_engine ? g_engine->sessionPool : nullptr;
+    return env->NewStringUTF(pool ? pool->stats().c_str() : "");
+}
+
+// 会话池吞吐：串行提交 vs 并发提交的 images/s
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_example_mnn_MainActivity_benchmarkSessionPool(JNIEnv* env, jobject thiz, jobject src, jint styleId, jint steps, jint iters) {
+    std::lock_guard<std::mutex> lock(g_engineMutex);
+    if (!g_engine) return env->NewStringUTF("");
+    void* pixels = nullptr;
+    AndroidBitmap_lockPixels(env, src, &pixels);
+    std::vector<uint8_t> input((const uint8_t*)pixels, (const uint8_t*)pixels + 512 * 512 * 4);
+    AndroidBitmap_unlockPixels(env, src);
+    return env->NewStringUTF(g_engine->benchmarkSessionPool(input.data(), (int)styleId, (int)steps, (int)iters).c_str());
+}
+
+// 吞吐基准：batch 1/2/4/8 的 images/s
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_example_mnn_MainActivity_benchmarkBatchThroughput(JNIEnv* env, jobject thiz, jobject src, jint styleId, jint steps, jint iters) {
+    std::lock_guard<std::mutex> lock(g_engineMutex);
+    if (!g_engine) return env->NewStringUTF("");
+    void* pixels = nullptr;
+    AndroidBitmap_lockPixels(env, src, &pixels);
+    std::string report = g_engine->benchmarkBatchThroughput((const uint8_t*)pixels, (int)styleId, (int)steps, (int)iters);
+    AndroidBitmap_unlockPixels(env, src);
+    return env->NewStringUTF(report.c_str());
+}
+
+// 经调度器排队的单图推理：与其他并发请求合并成 batch，阻塞直到完成
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_example_mnn_MainActivity_runStyleTransferQueued(JNIEnv* env, jobject thiz, jobject src, jobject dst, jint styleId, jint steps, jobject jOpts) {
+    BatchScheduler::Request req;
+    req.opts = readRunOptions(env, jOpts);
+    req.opts.style = (int)styleId;
+    req.opts.steps = (int)steps;
+    void* pixels = nullptr;
+    AndroidBitmap_lockPixels(env, src, &pixels);
+    req.input.assign((const uint8_t*)pixels, (const uint8_t*)pixels + 512 * 512 * 4);
+    AndroidBitmap_unlockPixels(env, src);
+    if (!g_scheduler.submit(req)) return JNI_FALSE;
+    AndroidBitmap_lockPixels(env, dst, &pixels);
+    memcpy(pixels, req.output.data(), req.output.size());
+    AndroidBitmap_unlockPixels(env, dst);
+    return JNI_TRUE;
+}
+
+// 异步提交：返回任务 id，listener 可为空；supersede 为 true 时取消此前未结束的任务
+extern "C" JNIEXPORT jint JNICALL
+Java_com_example_mnn_MainActivity_submitStyleJob(JNIEnv* env, jobject thiz, jobject src, jint styleId, jint steps, jobject jOpts,
+                                                  jobject listener, jboolean supersede) {
+    RunOptions opts = readRunOptions(env, jOpts);
+    opts.style = (int)styleId;
+    opts.steps = (int)steps;
+    void* pixels = nullptr;
+    AndroidBitmap_lockPixels(env, src, &pixels);
+    std::vector<uint8_t> input((const uint8_t*)pixels, (const uint8_t*)pixels + 512 * 512 * 4);
+    AndroidBitmap_unlockPixels(env, src);
+    return g_jobs.submit(env, std::move(input), opts, listener, supersede == JNI_TRUE);
+}
+
+// 任务状态 [state, step, total, elapsedMs]，任务不存在时 state 为 -1
+extern "C" JNIEXPORT jintArray JNICALL
+Java_com_example_mnn_MainActivity_pollJob(JNIEnv* env, jobject thiz, jint jobId) {
+    jint info[4] = {-1, 0, 0, 0};
+    g_jobs.poll((int)jobId, info);
+    jintArray arr = env->NewIntArray(4);
+    env->SetIntArrayRegion(arr, 0, 4, info);
+    return arr;
+}
+
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_example_mnn_MainActivity_cancelJob(JNIEnv* env, jobject thiz, jint jobId) {
+    return g_jobs.cancel((int)jobId) ? JNI_TRUE : JNI_FALSE;
+}
+
+// 已完成任务的结果写入 dst，取走后任务不再保留
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_example_mnn_MainActivity_fetchJobResult(JNIEnv* env, jobject thiz, jint jobId, jobject dst) {
+    void* pixels = nullptr;
+    AndroidBitmap_lockPixels(env, dst, &pixels);
+    bool ok = g_jobs.fetch((int)jobId, (uint8_t*)pixels);
+    AndroidBitmap_unlockPixels(env, dst);
+    return ok ? JNI_TRUE : JNI_FALSE;
+}
+
+// 取消 / 时间预算的响应延迟：算子级与步边界两种检查粒度对比
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_example_mnn_MainActivity_benchmarkCancelLatency(JNIEnv* env, jobject thiz, jobject src, jint styleId, jint steps, jint iters) {
+    std::lock_guard<std::mutex> lock(g_engineMutex);
+    if (!g_engine) return env->NewStringUTF("");
+    void* pixels = nullptr;
+    AndroidBitmap_lockPixels(env, src, &pixels);
+    std::vector<uint8_t> input((const uint8_t*)pixels, (const uint8_t*)pixels + 512 * 512 * 4);
+    AndroidBitmap_unlockPixels(env, src);
+    return env->NewStringUTF(g_engine->benchmarkCancelLatency(input.data(), (int)styleId, (int)steps, (int)iters).c_str());
+}
+
+// 调度参数：最大 batch 与队首最长等待时间
+extern "C" JNIEXPORT void JNICALL
+Java_com_example_mnn_MainActivity_configureScheduler(JNIEnv* env, jobject thiz, jint maxBatch, jfloat maxWaitMs) {
+    g_scheduler.configure((int)maxBatch, (float)maxWaitMs);
+}
+
+// 调度统计：队列深度、batch 大小分布、排队延迟
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_example_mnn_MainActivity_getSchedulerStats(JNIEnv* env, jobject thiz) {
+    return env->NewStringUTF(g_scheduler.stats().c_str());
+}
+
+// 粗到细调度的逐 split 点 PSNR / 延迟
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_example_mnn_MainActivity_benchmarkCoarseToFine(JNIEnv* env, jobject thiz, jobject src, jobject dst, jint styleId, jint steps) {
+    std::lock_guard<std::mutex> lock(g_engineMutex);
+    if (!g_engine) return env->NewStringUTF("");
+    return env->NewStringUTF(g_engine->benchmarkCoarseToFine(env, src, dst, (int)styleId, (int)steps).c_str());
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_example_mnn_MainActivity_benchmarkWholeGraph(JNIEnv* env, jobject thiz, jobject src, jobject dst, jint styleId, jint steps, jint iters) {
+    std::lock_guard<std::mutex> lock(g_engineMutex);
+    if (!g_engine) return env->NewStringUTF("");
+    return env->NewStringUTF(g_engine->benchmarkWholeGraph(env, src, dst, (int)styleId, (int)steps, (int)iters).c_str());
+}
+
+// 最近一次推理的统计信息（solver / Flow 调用次数 / 各阶段耗时）
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_example_mnn_MainActivity_getLastRunStats(JNIEnv* env, jobject thiz) {
+    std::lock_guard<std::mutex> lock(g_engineMutex);
+    if (!g_engine) return env->NewStringUTF("");
+    return env->NewStringUTF(g_engine->lastStats.summary().c_str());
+}
+
+// 微基准：Flow 单步 Host 侧开销 (旧路径 vs 融合路径)
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_example_mnn_MainActivity_benchmarkStepOverhead(JNIEnv* env, jobject thiz, jint iters) {
+    std::lock_guard<std::mutex> lock(g_engineMutex);
+    if (!g_engine) return env->NewStringUTF("");
+    return env->NewStringUTF(g_engine->benchmarkStepOverhead((int)iters).c_str());
 }
\ No newline at end of file
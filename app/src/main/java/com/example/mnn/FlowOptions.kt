@@ -0,0 +1,73 @@
+package com.example.mnn
+
+// Flow 积分器编号，需与 native-lib.cpp 中的 FlowSolver 保持一致
+object FlowSolver {
+    const val EULER = 0
+    const val HEUN = 1
+    const val MIDPOINT = 2
+    const val RK4 = 3
+    const val ADAMS_BASHFORTH = 4
+    const val ADAPTIVE = 5
+}
+
+// 传给 runStyleTransfer 的 Flow 推理参数 (JNI 按字段名读取，改名需同步 C++)
+data class FlowOptions(
+    val solver: Int = FlowSolver.EULER,
+    // 积分区间数，0 表示与 steps 相同；高阶 solver 可用更少区间到达同一终点
+    val solverSteps: Int = 0,
+    // ADAPTIVE 的局部误差容限，越大 Flow 调用越少
+    val tolerance: Float = 1e-3f,
+    // 收敛提前结束：单步相对更新量 |v·dt|/|x| 低于该值即停止，0 关闭
+    val earlyStop: Float = 0f,
+    // 提前结束判据使用最大值范数 (默认 L2)
+    val earlyStopMaxNorm: Boolean = false,
+    // 速度复用：latent 范数相对漂移低于该值时复用上一次 Flow 输出，0 关闭
+    val reuseDrift: Float = 0f,
+    // 最多连续复用次数 (1 约等于 Flow 调用减半)
+    val maxReuse: Int = 1,
+    // Flow 循环保持后端原生排布 (如 NC4HW4)，只在 Decoder 边界转换一次；不支持时自动回退
+    val nativeLayout: Boolean = true,
+    // Euler 使用 Express Module：x + v·dt 并入 Flow 图，模型不支持时自动回退 Interpreter
+    val expressStep: Boolean = false,
+    // Euler 展开步数：K 次 Flow 与中间更新合成一个 Module 一次执行 (如 4 步默认值只需 1 次 dispatch)，<=1 关闭
+    val unroll: Int = 0,
+    // condition 缓存：Flow 中只依赖 x_cond / s 的分支每张图只算一次，图切不开时自动回退
+    val condCache: Boolean = true,
+    // 风格特化 Flow 图：s 固化为常量并折叠风格嵌入，每个风格首次使用时构建并缓存到磁盘
+    val styleGraph: Boolean = false,
+    // 时间嵌入表：t 只取 i·0.05，时间嵌入在模型加载时预先算好，每步直接查表
+    val timeTable: Boolean = true,
+    // CFG 强度 w：每步 v = v_u + w·(v_c - v_u)，条件 / 无条件分支在一次 batch 2 调用中完成，0 关闭
+    val guidance: Float = 0f,
+    // 无条件分支使用的风格 id (训练时留作 null style 的编号)；guidance > 0 时必须设置，-1 (未设置) 时请求被拒绝
+    val nullStyle: Int = -1,
+    // 精度调度：最后 fp32Steps 步改用 FP32 (Precision_Normal) 的 Flow Session，其余仍为 FP16，0 关闭
+    val fp32Steps: Int = 0,
+    // 粗到细：前 coarseSteps 步在 4×32×32 latent 上积分 (约 1/4 计算量)，再上采样回 64×64，0 关闭
+    val coarseSteps: Int = 0,
+    // 反归一化 / 截断 / RGBA 打包并入 Decoder 图，在 MNN 线程池中执行；构建失败时自动回退主机循环
+    val graphRender: Boolean = true,
+    // 整图流水线：Encoder → Flow×steps → Decoder 合成一个 Module，模型边界不经主机拷贝，只用于固定网格 Euler
+    val wholeGraph: Boolean = false,
+    // 墙钟时间预算 (ms)：超出即在算子边界中止本次推理 (异步任务状态为 TIMED_OUT)，0 不限
+    val deadlineMs: Float = 0f
+)
+
+// 异步任务状态 (pollJob 返回数组的第 0 项)，需与 native-lib.cpp 中 JobManager::State 保持一致
+object JobState {
+    const val UNKNOWN = -1
+    const val QUEUED = 0
+    const val RUNNING = 1
+    const val DONE = 2
+    const val FAILED = 3
+    const val CANCELLED = 4
+    const val TIMED_OUT = 5
+    // 结果未及时取走，被较新的结果挤出 (fetchJobResult 返回 false)
+    const val EXPIRED = 6
+}
+
+// 异步任务的逐步进度回调 (JNI 按 onProgress(IIIF)V 调用)：在 native 的通知线程上执行，不持有引擎锁，
+// 回调内可以调用 native 方法；回调慢于推理时中间的进度会合并，只收到最新一次
+fun interface JobProgressListener {
+    fun onProgress(jobId: Int, step: Int, total: Int, elapsedMs: Float)
+}
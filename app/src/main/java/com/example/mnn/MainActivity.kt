@@ -41,9 +41,32 @@ import java.util.Locale
 
 class MainActivity : ComponentActivity() {
 
-    // Native 方法：注意增加了 steps 参数
+    // Native 方法：注意增加了 steps 与 options 参数
     external fun initEngine(cacheDir: String): Boolean
-    external fun runStyleTransfer(src: Bitmap, dst: Bitmap, styleId: Int, steps: Int): Boolean
+    external fun runStyleTransfer(src: Bitmap, dst: Bitmap, styleId: Int, steps: Int, options: FlowOptions): Boolean
+    external fun runStyleBatch(src: Bitmap, dsts: Array<Bitmap>, styleIds: IntArray, steps: Int, options: FlowOptions): Boolean
+    external fun runImageBatch(srcs: Array<Bitmap>, dsts: Array<Bitmap>, styleId: Int, steps: Int, options: FlowOptions): Boolean
+    external fun runStylePipeline(srcs: Array<Bitmap>, dsts: Array<Bitmap>, styleId: Int, steps: Int, options: FlowOptions): Boolean
+    external fun configureStagePipeline(encCores: IntArray?, flowCores: IntArray?, decCores: IntArray?)
+    external fun getStagePipelineStats(): String
+    external fun submitStyleJob(src: Bitmap, styleId: Int, steps: Int, options: FlowOptions,
+                                listener: JobProgressListener?, supersede: Boolean): Int
+    external fun pollJob(jobId: Int): IntArray
+    external fun cancelJob(jobId: Int): Boolean
+    external fun fetchJobResult(jobId: Int, dst: Bitmap): Boolean
+    external fun runStyleTransferQueued(src: Bitmap, dst: Bitmap, styleId: Int, steps: Int, options: FlowOptions): Boolean
+    external fun runStyleTransferPooled(src: Bitmap, dst: Bitmap, styleId: Int, steps: Int, options: FlowOptions): Boolean
+    external fun configureSessionPool(slots: Int, threadsPerSlot: Int)
+    external fun getSessionPoolStats(): String
+    external fun configureScheduler(maxBatch: Int, maxWaitMs: Float)
+    external fun getSchedulerStats(): String
+    external fun getLastRunStats(): String
+    external fun benchmarkStepOverhead(iterations: Int): String
+    external fun benchmarkBatchThroughput(src: Bitmap, styleId: Int, steps: Int, iterations: Int): String
+    external fun benchmarkSessionPool(src: Bitmap, styleId: Int, steps: Int, iterations: Int): String
+    external fun benchmarkCoarseToFine(src: Bitmap, dst: Bitmap, styleId: Int, steps: Int): String
+    external fun benchmarkCancelLatency(src: Bitmap, styleId: Int, steps: Int, iterations: Int): String
+    external fun benchmarkWholeGraph(src: Bitmap, dst: Bitmap, styleId: Int, steps: Int, iterations: Int): String
 
     companion object {
         init {
@@ -146,6 +169,7 @@ class MainActivity : ComponentActivity() {
         }
 
         val steps = viewModel.uiState.value.steps
+        val options = viewModel.uiState.value.flowOptions
         viewModel.setProcessing(true)
         viewModel.updateStatus("生成中 (CPU: $steps 步)...")
 
@@ -156,14 +180,16 @@ class MainActivity : ComponentActivity() {
 
                 val start = System.currentTimeMillis()
                 // 调用 Native，传入 steps
-                val success = runStyleTransfer(input, output, styleId, steps)
+                val success = runStyleTransfer(input, output, styleId, steps, options)
                 val cost = System.currentTimeMillis() - start
+                val stats = if (success) getLastRunStats() else ""
+                if (success) writeLog(stats)
 
                 withContext(Dispatchers.Main) {
                     viewModel.setProcessing(false)
                     if (success) {
                         viewModel.setResult(output)
-                        viewModel.updateStatus("完成! 耗时: ${cost}ms")
+                        viewModel.updateStatus("完成! 耗时: ${cost}ms\n$stats")
                     } else {
                         viewModel.updateStatus("生成失败")
                     }
@@ -280,6 +306,32 @@ fun StyleTransferScreen(
             Spacer(modifier = Modifier.height(16.dp))
         }
 
+        // 积分器选择 (Flow Solver)
+        item {
+            val solvers = listOf(
+                FlowSolver.EULER to "Euler",
+                FlowSolver.HEUN to "Heun",
+                FlowSolver.MIDPOINT to "Mid",
+                FlowSolver.RK4 to "RK4",
+                FlowSolver.ADAMS_BASHFORTH to "AB3",
+                FlowSolver.ADAPTIVE to "Auto"
+            )
+            Row(modifier = Modifier.fillMaxWidth(), horizontalArrangement = Arrangement.SpaceEvenly) {
+                solvers.forEach { (id, label) ->
+                    OutlinedButton(
+                        onClick = { viewModel.setSolver(id) },
+                        enabled = !uiState.isProcessing,
+                        // 六个按钮一行，收窄内边距避免窄屏换行截断
+                        contentPadding = PaddingValues(horizontal = 8.dp),
+                        colors = ButtonDefaults.outlinedButtonColors(
+                            containerColor = if (uiState.flowOptions.solver == id) Color(0xFFE3F2FD) else Color.Transparent
+                        )
+                    ) { Text(label, fontSize = 12.sp) }
+                }
+            }
+            Spacer(modifier = Modifier.height(16.dp))
+        }
+
         // 步数滑块 (Steps Slider)
         item {
             Column(modifier = Modifier.fillMaxWidth().padding(horizontal = 8.dp)) {
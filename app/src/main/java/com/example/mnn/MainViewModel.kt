@@ -4,6 +4,7 @@ import android.app.Application
 import android.graphics.Bitmap
 import android.graphics.BitmapFactory
 import android.net.Uri
+import android.provider.OpenableColumns
 import androidx.lifecycle.AndroidViewModel
 import androidx.lifecycle.viewModelScope
 import kotlinx.coroutines.Dispatchers
@@ -42,6 +43,11 @@ class MainViewModel(application: Application) : AndroidViewModel(application) {
         _uiState.value = _uiState.value.copy(steps = steps)
     }
 
+    // 设置 Flow 积分器
+    fun setSolver(solver: Int) {
+        _uiState.value = _uiState.value.copy(flowOptions = _uiState.value.flowOptions.copy(solver = solver))
+    }
+
     // 处理图片选择
     fun onImageSelected(uri: Uri) {
         viewModelScope.launch(Dispatchers.IO) {
@@ -82,11 +88,19 @@ class MainViewModel(application: Application) : AndroidViewModel(application) {
                     return@launch
                 }
 
-                // 强制覆盖名为 Flow.mnn 的文件
-                val targetFile = File(cacheDir, "Flow.mnn")
+                // 调度描述 (*.schedule) 写到 Flow.schedule，其余一律强制覆盖 Flow.mnn
+                val displayName = contentResolver.query(uri, arrayOf(OpenableColumns.DISPLAY_NAME), null, null, null)?.use { c ->
+                    if (c.moveToFirst()) c.getString(0) else null
+                }
+                val isSchedule = displayName?.endsWith(".schedule") == true
+                val targetFile = File(cacheDir, if (isSchedule) "Flow.schedule" else "Flow.mnn")
                 if (targetFile.exists()) {
                     targetFile.delete()
                 }
+                if (!isSchedule) {
+                    // 旧模型的调度描述不适用于新模型，需要时随后再上传
+                    File(cacheDir, "Flow.schedule").delete()
+                }
 
                 FileOutputStream(targetFile).use { output ->
                     inputStream.copyTo(output)
@@ -139,5 +153,6 @@ data class UiState(
     val isProcessing: Boolean = false,
     val originalBitmap: Bitmap? = null,
     val resultBitmap: Bitmap? = null,
-    val steps: Int = 4 // 默认步数
+    val steps: Int = 4, // 默认步数
+    val flowOptions: FlowOptions = FlowOptions()
 )
\ No newline at end of file